@@ -0,0 +1,36 @@
+#!/bin/bash
+# Stage placement benchmark: times a 4-stage throughput pipeline
+# unpinned, with './driver -a' and with every stage on '@cpu=0'.
+# Usage: ./bench_placement.sh [size in MB] [runs]
+# Prints the median wall time of each mode in seconds.
+
+SIZE_MB=${1:-500}
+RUNS=${2:-5}
+INPUT=${TMPDIR:-/tmp}/bench_placement.$SIZE_MB
+DRIVER=$(dirname "$0")/driver
+
+if [ ! -x "$DRIVER" ]; then
+	echo "build ./driver first (make)" >&2
+	exit 1
+fi
+
+# Compressible text, so tr and wc have real work to do
+if [ ! -f "$INPUT" ]; then
+	base64 -w 76 /dev/urandom | head -c "${SIZE_MB}M" > "$INPUT"
+fi
+
+# Runs one command line through the driver RUNS times, prints the median
+median() {
+	local opts=$1 line=$2 i t times=()
+
+	for ((i = 0; i < RUNS; i++)); do
+		t=$( { TIMEFORMAT=%R; time printf '%s\n' "$line" | "$DRIVER" $opts > /dev/null 2>&1; } 2>&1 )
+		times+=("$t")
+	done
+	printf '%s\n' "${times[@]}" | sort -n | sed -n "$(( (RUNS + 1) / 2 ))p"
+}
+
+echo "cpus: $(nproc), sockets: $(lscpu -p=SOCKET 2>/dev/null | grep -v '^#' | sort -u | wc -l), input: ${SIZE_MB}M, runs: $RUNS"
+echo "unpinned:  $(median "" "cat $INPUT | tr a b | cat | wc -c")"
+echo "-a:        $(median "-a" "cat $INPUT | tr a b | cat | wc -c")"
+echo "@cpu=0:    $(median "" "cat $INPUT @cpu=0 | tr a b @cpu=0 | cat @cpu=0 | wc -c @cpu=0")"
@@ -6,6 +6,8 @@
 //
 //
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <assert.h>
 #include <sys/types.h>
@@ -16,6 +18,21 @@
 #include <string.h>
 #include <sysexits.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 /***********************************************************
  *  Structures
@@ -25,18 +42,63 @@ typedef struct command
 	char **argv;
 	int fdIn, fdOut;
 	int numRedirections, numCmdTokens;
+	cpu_set_t cpus;		// CPUs set by an @cpu= annotation or auto placement
+	int hasCpus, autoCpu;	// hasCpus is set once cpus is valid
+	int niceness, batch;	// @nice= increment and @batch (SCHED_BATCH)
+	char **globMem;	// Blocks holding the names that globs expanded to
+	int numGlobMem;
 
 } CMD;
 
+/* One stage of a fused run of builtins. push() hands a batch
+	of data to the stage and returns 1 once the stage wants no
+	more input, finish() flushes anything held back at EOF */
+typedef struct filter
+{
+	int (*push)(struct filter *, const char *, size_t);
+	int (*finish)(struct filter *);
+	struct filter *next;
+	char *carry;	// Partial line held over to the next batch
+	size_t carryLen, carryCap;
+	const char *pattern;	// grep -F
+	size_t patternLen;
+	long long lines;	// head -n lines left
+	struct asyncSink *files;	// tee's files, or the sink's stdout
+	int numFiles;
+	int status;	// Exit status of the stage
+
+} Filter;
+
 /***********************************************************
  *  Function Prototypes
  **********************************************************/
 char ** tokenize(char *, int *);
 int getInput(char **);
 int parseTokens(char **, int);
-int pipeline(CMD *, int, int);
+int pipeline(CMD *, int, int, int);
 void closeFD(int);
 void redirect(int, int);
+int parseStageHint(CMD *, char *);
+void autoPlaceStages(CMD *, int, int);
+void applyStageHints(CMD *);
+int execStage(CMD *);
+void meterEdge(int, int, int, const char *, const char *, int);
+int runBufferStage(CMD *);
+void stageFds(CMD *, int, int);
+static long long parseSize(const char *);
+int isCacheable(CMD *, int);
+void cachedPipeline(CMD *, int, int, int, const char *, long long);
+int fusedRunEnd(CMD *, int, int);
+int runFused(CMD *, int);
+void expandGlobs(CMD *);
+void historyOpen(void);
+void historyAdd(const char *, size_t);
+char *historySearch(const char *, int);
+
+void closeInherited(CMD *);
+
+extern int directIo;
+extern int fdDebug;
 
 /***********************************************************
  *  Main Function
@@ -44,10 +106,59 @@ void redirect(int, int);
 int main(int argc, char *argv[])
 {
 	char *buf;      // Contains input from stdin
-	CMD cmds[sizeof(CMD) * BUFSIZ];
+	CMD cmds[BUFSIZ];
 	int result;
 	int numPipes = 0;
 	int in, out;
+	int opt;
+	int autoPlace = 0;	// -a places every stage on sibling cores
+	int meterMs = 0;	// -m reports every pipe edge at this interval
+	char *cacheDir = NULL;	// -c memoizes pure pipelines in this directory
+	long long cacheLimit = 1LL << 30;	// -s caps the size of the cache
+
+	while ((opt = getopt(argc, argv, "am:c:s:Df")) != -1)
+	{
+		switch (opt)
+		{
+		case 'a':
+			autoPlace = 1;
+			break;
+		case 'm':
+			meterMs = (int)(strtod(optarg, NULL) * 1000);
+			if (meterMs <= 0)
+			{
+				fprintf(stderr, "Meter interval must be positive\n");
+				exit(EX_USAGE);
+			}
+			break;
+		case 'D':
+			directIo = 1;
+			break;
+		case 'f':
+			fdDebug = 1;
+			break;
+		case 'c':
+			cacheDir = optarg;
+			if (mkdir(cacheDir, 0700) == -1 && errno != EEXIST)
+			{
+				perror(cacheDir);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 's':
+			if ((cacheLimit = parseSize(optarg)) == -1)
+			{
+				fprintf(stderr, "Bad cache size: %s\n", optarg);
+				exit(EX_USAGE);
+			}
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-a] [-D] [-f] [-m seconds] [-c cachedir [-s size]]\n", argv[0]);
+			exit(EX_USAGE);
+		}
+	}
+
+	historyOpen();
 
 	while ((result = getInput(&buf)) != -1)
 	{
@@ -97,6 +208,15 @@ int main(int argc, char *argv[])
 			cmds[i].argv = malloc(sizeof(char) * BUFSIZ);
 			cmds[i].numCmdTokens = 0;
 			cmds[i].numRedirections = 0;
+			cmds[i].fdIn = STDIN_FILENO;
+			cmds[i].fdOut = STDOUT_FILENO;
+			CPU_ZERO(&cmds[i].cpus);
+			cmds[i].hasCpus = 0;
+			cmds[i].autoCpu = 0;
+			cmds[i].niceness = 0;
+			cmds[i].batch = 0;
+			cmds[i].globMem = NULL;
+			cmds[i].numGlobMem = 0;
 		}
 
 		/* Add the tokens to the argument vectors in command structure */
@@ -125,6 +245,31 @@ int main(int argc, char *argv[])
 			free(token);
 		}
 
+		/* Pull the @ scheduling annotations out of the argument vectors */
+		for (i = 0; i < numCmds; i++)
+		{
+			int k = 0;
+
+			for (j = 0; j < cmds[i].numCmdTokens; j++)
+			{
+				if (cmds[i].argv[j][0] == '@' && parseStageHint(&cmds[i], cmds[i].argv[j]))
+				{
+					continue;
+				}
+				cmds[i].argv[k++] = cmds[i].argv[j];
+			}
+
+			cmds[i].numCmdTokens = k;
+			cmds[i].argv[k] = NULL;
+		}
+		autoPlaceStages(cmds, numCmds, autoPlace);
+
+		/* Expand *, ? and [...] in the argument vectors */
+		for (i = 0; i < numCmds; i++)
+		{
+			expandGlobs(&cmds[i]);
+		}
+
 		/* Look for redirection symbols in the argument vectors */
 		for (i = 0; i < numCmds; i++)
 		{
@@ -133,7 +278,7 @@ int main(int argc, char *argv[])
 				if (strcmp(cmds[i].argv[j], "<") == 0)
 				{
 					/* Open input file if it exists */
-					if ((cmds[i].fdIn = open(cmds[i].argv[j + 1], O_RDONLY)) == -1)
+					if ((cmds[i].fdIn = open(cmds[i].argv[j + 1], O_RDONLY | O_CLOEXEC)) == -1)
 					{
 						perror(cmds[i].argv[j + 1]);
 						exit(EXIT_FAILURE);
@@ -145,7 +290,7 @@ int main(int argc, char *argv[])
 				else if (strcmp(cmds[i].argv[j], ">") == 0)
 				{
 					/* open output file. if it doesnt exist, create it. */
-					if ((cmds[i].fdOut = open(cmds[i].argv[j + 1], O_WRONLY | O_CREAT | O_TRUNC)) == -1)
+					if ((cmds[i].fdOut = open(cmds[i].argv[j + 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
 					{
 						perror(cmds[i].argv[j + 1]);
 						exit(EXIT_FAILURE);
@@ -158,11 +303,23 @@ int main(int argc, char *argv[])
 		}
 
 		/* run the multipipelined command shell */
-		pipeline(cmds, numPipes, numCmds);
+		if (cacheDir && isCacheable(cmds, numCmds))
+		{
+			cachedPipeline(cmds, numPipes, numCmds, meterMs, cacheDir, cacheLimit);
+		}
+		else
+		{
+			pipeline(cmds, numPipes, numCmds, meterMs);
+		}
 
 		/* Free Memory */
 		for (i = 0; i < numCmds; i++)
 		{
+			for (j = 0; j < cmds[i].numGlobMem; j++)
+			{
+				free(cmds[i].globMem[j]);
+			}
+			free(cmds[i].globMem);
 			free(cmds[i].argv);
 			free(tempV[i]);
 		}
@@ -176,10 +333,16 @@ int main(int argc, char *argv[])
 
 /***********************************************************
  *  Get line of input from stdin
+ *  History references are replaced by the command they find:
+ *	!!	the last command
+ *	!text	the last command starting with text
+ *	!?text	the last command containing text
+ *  Every command that is run is added to the history
  **********************************************************/
 int getInput(char **buffer)
 {
 	int bytesRead;
+	size_t len;
 	size_t numBytes = BUFSIZ;
 	*buffer = malloc(sizeof(char) * BUFSIZ);
 
@@ -198,6 +361,43 @@ int getInput(char **buffer)
 	}
 	printf("\n");
 
+	len = strcspn(*buffer, "\n");
+	if ((*buffer)[0] == '!' && len > 1)
+	{
+		char *found;
+
+		(*buffer)[len] = '\0';
+		if (strcmp(*buffer, "!!") == 0)
+		{
+			found = historySearch("", 1);
+		}
+		else if ((*buffer)[1] == '?')
+		{
+			found = historySearch(*buffer + 2, 0);
+		}
+		else
+		{
+			found = historySearch(*buffer + 1, 1);
+		}
+
+		if (!found)
+		{
+			fprintf(stderr, "%s: event not found\n", *buffer);
+			free(*buffer);
+			return getInput(buffer);	// Ask again
+		}
+
+		printf("%s\n", found);
+		free(*buffer);
+		*buffer = found;
+		len = strlen(found);
+	}
+
+	if (len > 0)
+	{
+		historyAdd(*buffer, len);
+	}
+
 	return 0;
 }
 
@@ -356,10 +556,12 @@ int parseTokens(char **tokens, int numTokens)
 
 /***********************************************************
  *  Implementation of multi-pipelined shell
+ *  When meterMs is set every pipe gets a relay process that
+ *  reports the traffic on that edge
  **********************************************************/
-int pipeline(CMD *cmds, int numPipes, int numCmds)
+int pipeline(CMD *cmds, int numPipes, int numCmds, int meterMs)
 {
-	int i, j;
+	int i;
 	int in = STDIN_FILENO;
 
 	/* Loop for number of pipes */
@@ -367,8 +569,17 @@ int pipeline(CMD *cmds, int numPipes, int numCmds)
 	{
 		int fd[2];
 		pid_t pid;  // Child's pid
+		int start = i;
 
-		if (pipe(fd) == -1)
+		/* Adjacent builtins run as one process with no pipes between them.
+			If the run reaches the last stage, the parent runs it below */
+		if ((i = fusedRunEnd(cmds, start, numCmds)) == numPipes)
+		{
+			i = start;
+			break;
+		}
+
+		if (pipe2(fd, O_CLOEXEC) == -1)
 		{
 			perror("pipe");
 			exit(EXIT_FAILURE);
@@ -383,23 +594,14 @@ int pipeline(CMD *cmds, int numPipes, int numCmds)
 		if (pid == 0)   // Child
 		{
 			closeFD(fd[0]);
-			if (cmds[i].fdIn && cmds[i].fdIn != STDIN_FILENO)
-			{
-				redirect(in, cmds[i].fdIn);
-				redirect(fd[1], STDOUT_FILENO);
-			}
-			else if (cmds[i].fdOut && cmds[i].fdOut != STDOUT_FILENO)
-			{
-				redirect(in, STDIN_FILENO);
-				redirect(cmds[i].fdOut, STDOUT_FILENO);
-			}
-			else
+			stageFds(&cmds[start], in, fd[1]);
+
+			if (i > start)
 			{
-				redirect(in, STDIN_FILENO);
-				redirect(fd[1], STDOUT_FILENO);
+				stageFds(&cmds[i], STDIN_FILENO, STDOUT_FILENO);
+				exit(runFused(&cmds[start], i - start + 1));
 			}
-
-			return execvp(cmds[i].argv[0], (char * const *)cmds[i].argv);
+			return execStage(&cmds[i]);
 		}
 		else    // Parent
 		{
@@ -408,47 +610,133 @@ int pipeline(CMD *cmds, int numPipes, int numCmds)
 			closeFD(in);
 			in = fd[0];
 		}
+
+		/* Put the meter between this stage and the next one */
+		if (meterMs > 0)
+		{
+			int relay[2];
+
+			if (pipe2(relay, O_CLOEXEC) == -1)
+			{
+				perror("pipe");
+				exit(EXIT_FAILURE);
+			}
+
+			if ((pid = fork()) == -1)
+			{
+				perror("fork");
+				exit(EXIT_FAILURE);
+			}
+
+			if (pid == 0)
+			{
+				/* Only the two pipes of this edge stay open in the relay */
+				closeFD(relay[0]);
+				redirect(in, STDIN_FILENO);
+				redirect(relay[1], STDOUT_FILENO);
+				closeInherited(NULL);
+				meterEdge(i + 1, STDIN_FILENO, STDOUT_FILENO, cmds[i].argv[0], cmds[i + 1].argv[0], meterMs);
+				exit(EXIT_SUCCESS);
+			}
+
+			closeFD(relay[1]);
+			closeFD(in);
+			in = relay[0];
+		}
 	}
 
-	// Need to implement something of the sort for I/O redirection
-	//if (file_fd != 1) { dup2(file_fd, 1); close(file_fd); }
+	stageFds(&cmds[i], in, STDOUT_FILENO);
+	if (numPipes > i)
+	{
+		stageFds(&cmds[numPipes], STDIN_FILENO, STDOUT_FILENO);
+		exit(runFused(&cmds[i], numPipes - i + 1));
+	}
 
-	/* Redirect file descriptors one more time */
-	for (i = 0; i < numCmds; i++)
+	/* Execute the last stage with the current process. Do not wait for the
+		earlier stages first, they block as soon as their pipes fill up */
+	return execStage(&cmds[numPipes]);
+}
+
+/***********************************************************
+ *  Connects a stage to its pipes. A redirection given for
+ *  the stage wins over the pipe
+ **********************************************************/
+void stageFds(CMD *cmd, int in, int out)
+{
+	redirect(in, STDIN_FILENO);
+	redirect(out, STDOUT_FILENO);
+
+	if (cmd->fdIn != STDIN_FILENO)
+	{
+		redirect(cmd->fdIn, STDIN_FILENO);
+	}
+	if (cmd->fdOut != STDOUT_FILENO)
+	{
+		redirect(cmd->fdOut, STDOUT_FILENO);
+	}
+}
+
+/***********************************************************
+ *  Closes everything but stdin, stdout and stderr once a
+ *  stage's descriptors are in place. The shell opens its own
+ *  descriptors close-on-exec, this also covers builtins that
+ *  never exec and anything the shell itself inherited.
+ *  With -f the descriptors the stage (or meter relay, when
+ *  cmd is NULL) inherited are listed
+ **********************************************************/
+int fdDebug = 0;	// -f
+
+void closeInherited(CMD *cmd)
+{
+	int fd;
+
+	if (fdDebug)
 	{
-		if (cmds[i].fdIn && cmds[i].fdIn != STDIN_FILENO)
+		DIR *dir = opendir("/proc/self/fd");
+		struct dirent *de;
+		char line[BUFSIZ], target[PATH_MAX], link[64];
+		int len = snprintf(line, sizeof(line), "fds of %s [%d]:", cmd ? cmd->argv[0] : "meter", (int)getpid());
+
+		while (dir && (de = readdir(dir)) != NULL)
 		{
-			redirect(in, cmds[i].fdIn);
-			redirect(STDOUT_FILENO, STDOUT_FILENO);
-			for (i = 0; i < numPipes; i++)
+			ssize_t n;
+
+			if (de->d_name[0] == '.' || (fd = atoi(de->d_name)) == dirfd(dir))
 			{
-				wait(NULL);
+				continue;
+			}
+			snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+			if ((n = readlink(link, target, sizeof(target) - 1)) == -1)
+			{
+				continue;
+			}
+			target[n] = '\0';
+			if (len < (int)sizeof(line))
+			{
+				const char *note = "";
+
+				if (fd > STDERR_FILENO)
+				{
+					note = (fcntl(fd, F_GETFD) & FD_CLOEXEC) ? " (cloexec)" : " (leaked)";
+				}
+				len += snprintf(line + len, sizeof(line) - len, " %d=%s%s", fd, target, note);
 			}
-			return execvp(cmds[i].argv[0], (char * const *)cmds[i].argv);
 		}
-		else if (cmds[i].fdOut && cmds[i].fdOut != STDOUT_FILENO)
+		if (dir)
 		{
-			redirect(in, STDIN_FILENO);
-			redirect(cmds[i].fdOut, STDOUT_FILENO);
-			for (i = 0; i < numPipes; i++)
-			{ 
-				wait(NULL);
-			}
-			return execvp(cmds[i].argv[0], (char * const *)cmds[i].argv);
+			closedir(dir);
 		}
+		fprintf(stderr, "%s\n", line);
 	}
 
-	redirect(in, STDIN_FILENO);
-	redirect(STDOUT_FILENO, STDOUT_FILENO);
-
-	/* Not sure if this is the correct place - It works though */
-	for (i = 0; i < numPipes; i++)
+	if (close_range(STDERR_FILENO + 1, ~0U, 0) == -1)
 	{
-		wait(NULL);
+		/* Kernels before 5.9 */
+		for (fd = STDERR_FILENO + 1; fd < sysconf(_SC_OPEN_MAX); fd++)
+		{
+			close(fd);
+		}
 	}
-
-	/* Execute the last stage with the current process. */
-	return execvp(cmds[i].argv[0], (char * const *)cmds[i].argv);
 }
 
 /***********************************************************
@@ -484,4 +772,2964 @@ void redirect(int oldfd, int newfd)
 			exit(EXIT_FAILURE);
 		}
 	}
-}
\ No newline at end of file
+	else
+	{
+		/* Already in place, but it may have been opened close-on-exec */
+		fcntl(newfd, F_SETFD, 0);
+	}
+}
+
+/***********************************************************
+ *  Parses a stage annotation such as @cpu=2-3, @cpu=auto,
+ *  @nice=5 or @batch. Returns 1 if the token was consumed
+ **********************************************************/
+int parseStageHint(CMD *cmd, char *hint)
+{
+	char *end;
+
+	if (strncmp(hint, "@cpu=", 5) == 0)
+	{
+		char *list = hint + 5;
+
+		if (strcmp(list, "auto") == 0)
+		{
+			cmd->autoCpu = 1;
+			return 1;
+		}
+
+		/* CPU list in the same format as taskset -c: 0,2-3,6 */
+		while (*list)
+		{
+			long lo = strtol(list, &end, 10);
+			long hi = lo;
+
+			if (end == list || lo < 0)
+			{
+				fprintf(stderr, "Bad CPU list: %s\n", hint);
+				return 1;
+			}
+			if (*end == '-')
+			{
+				list = end + 1;
+				hi = strtol(list, &end, 10);
+				if (end == list || hi < lo)
+				{
+					fprintf(stderr, "Bad CPU list: %s\n", hint);
+					return 1;
+				}
+			}
+			for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+			{
+				CPU_SET(lo, &cmd->cpus);
+			}
+
+			list = (*end == ',') ? end + 1 : end;
+			if (*end && *end != ',')
+			{
+				fprintf(stderr, "Bad CPU list: %s\n", hint);
+				return 1;
+			}
+		}
+		cmd->hasCpus = CPU_COUNT(&cmd->cpus) > 0;
+		return 1;
+	}
+	else if (strncmp(hint, "@nice=", 6) == 0)
+	{
+		cmd->niceness = strtol(hint + 6, &end, 10);
+		if (*end)
+		{
+			fprintf(stderr, "Bad nice value: %s\n", hint);
+			cmd->niceness = 0;
+		}
+		return 1;
+	}
+	else if (strcmp(hint, "@batch") == 0)
+	{
+		cmd->batch = 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+/***********************************************************
+ *  Reads a single integer from a sysfs topology file,
+ *  returns -1 if it is not available
+ **********************************************************/
+static int readTopology(int cpu, const char *name)
+{
+	char path[128];
+	FILE *fp;
+	int value = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+	if ((fp = fopen(path, "re")) != NULL)
+	{
+		if (fscanf(fp, "%d", &value) != 1)
+		{
+			value = -1;
+		}
+		fclose(fp);
+	}
+
+	return value;
+}
+
+/***********************************************************
+ *  Position of a CPU among the hyperthreads of its core: 0
+ *  for the lowest numbered thread, 1 for the next and so on.
+ *  Returns 0 if the topology is not available
+ **********************************************************/
+static int threadRank(int cpu)
+{
+	char path[128], list[256];
+	char *p = list, *end;
+	FILE *fp;
+	int rank = 0;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+	if ((fp = fopen(path, "re")) == NULL)
+	{
+		return 0;
+	}
+	if (!fgets(list, sizeof(list), fp))
+	{
+		list[0] = '\0';
+	}
+	fclose(fp);
+
+	/* Same format as the @cpu= lists: 0,4 or 0-1 */
+	while (*p)
+	{
+		long lo = strtol(p, &end, 10);
+		long hi = lo;
+
+		if (end == p)
+		{
+			break;
+		}
+		if (*end == '-')
+		{
+			p = end + 1;
+			hi = strtol(p, &end, 10);
+		}
+		for (; lo <= hi && lo < cpu; lo++)
+		{
+			rank++;
+		}
+		p = (*end == ',') ? end + 1 : end;
+		if (*end != ',')
+		{
+			break;
+		}
+	}
+
+	return rank;
+}
+
+/***********************************************************
+ *  Automatic placement. The CPUs we are allowed to run on
+ *  are ordered by package, then hyperthread, then core, so
+ *  every core of a socket is used once before any core gets
+ *  a second stage on its other thread. Stage i gets CPU i of
+ *  that order, which puts a producer and its consumer on
+ *  sibling cores of the same socket
+ **********************************************************/
+void autoPlaceStages(CMD *cmds, int numCmds, int placeAll)
+{
+	cpu_set_t allowed;
+	int order[CPU_SETSIZE];
+	int key[CPU_SETSIZE];
+	int numCpus = 0;
+	int i, j;
+
+	for (i = 0; i < numCmds; i++)
+	{
+		if (placeAll || cmds[i].autoCpu)
+		{
+			break;
+		}
+	}
+	if (i == numCmds)
+	{
+		return;
+	}
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+	{
+		perror("sched_getaffinity");
+		return;
+	}
+
+	/* Insertion sort on (package, thread, core), the set is small */
+	for (i = 0; i < CPU_SETSIZE; i++)
+	{
+		if (!CPU_ISSET(i, &allowed))
+		{
+			continue;
+		}
+
+		int package = readTopology(i, "physical_package_id");
+		int core = readTopology(i, "core_id");
+		int k = ((package < 0 ? 0 : package) * 16 + threadRank(i)) * 65536 + (core < 0 ? i : core);
+
+		for (j = numCpus; j > 0 && key[j - 1] > k; j--)
+		{
+			key[j] = key[j - 1];
+			order[j] = order[j - 1];
+		}
+		key[j] = k;
+		order[j] = i;
+		numCpus++;
+	}
+
+	if (numCpus == 0)
+	{
+		return;
+	}
+
+	for (i = 0; i < numCmds; i++)
+	{
+		if (cmds[i].autoCpu || (placeAll && !cmds[i].hasCpus))
+		{
+			CPU_ZERO(&cmds[i].cpus);
+			CPU_SET(order[i % numCpus], &cmds[i].cpus);
+			cmds[i].hasCpus = 1;
+		}
+	}
+}
+
+/***********************************************************
+ *  Applies the scheduling hints of a stage to the calling
+ *  process. These are only hints, so failures are reported
+ *  and the stage still runs
+ **********************************************************/
+void applyStageHints(CMD *cmd)
+{
+	if (cmd->hasCpus && sched_setaffinity(0, sizeof(cmd->cpus), &cmd->cpus) == -1)
+	{
+		perror("sched_setaffinity");
+	}
+
+	if (cmd->batch)
+	{
+		struct sched_param param = { 0 };
+
+		if (sched_setscheduler(0, SCHED_BATCH, &param) == -1)
+		{
+			perror("sched_setscheduler");
+		}
+	}
+
+	if (cmd->niceness)
+	{
+		errno = 0;
+		if (nice(cmd->niceness) == -1 && errno)
+		{
+			perror("nice");
+		}
+	}
+}
+
+/***********************************************************
+ *  Executes one stage of the pipeline in this process
+ **********************************************************/
+int execStage(CMD *cmd)
+{
+	closeInherited(cmd);
+	applyStageHints(cmd);
+
+	/* Builtin stages run in this process and never return */
+	if (strcmp(cmd->argv[0], "buf") == 0)
+	{
+		exit(runBufferStage(cmd));
+	}
+
+	return execvp(cmd->argv[0], (char * const *)cmd->argv);
+}
+
+/***********************************************************
+ *  Formats a byte count with a binary suffix
+ **********************************************************/
+static const char *humanBytes(double bytes, char *buf, size_t size)
+{
+	const char *units = "BKMGT";
+
+	while (bytes >= 1024 && units[1])
+	{
+		bytes /= 1024;
+		units++;
+	}
+	snprintf(buf, size, "%.1f%c", bytes, *units);
+
+	return buf;
+}
+
+/***********************************************************
+ *  Returns the milliseconds on the monotonic clock
+ **********************************************************/
+static long long nowMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/***********************************************************
+ *  Meter relay for one edge of the pipeline. Moves data from
+ *  the producer's pipe to the consumer's pipe with splice so
+ *  nothing is copied through user space, and every interval
+ *  reports on stderr:
+ *	- bytes/s moved across the edge since the last report
+ *	- bytes sitting in the two pipes out of their capacity
+ *	- writer-blocked when the producer's pipe is full,
+ *	  reader-blocked when both pipes are empty
+ **********************************************************/
+void meterEdge(int edge, int fdIn, int fdOut, const char *from, const char *to, int meterMs)
+{
+	long long total = 0, sinceReport = 0;
+	long long start = nowMs(), lastReport = start;
+	int capacity;
+	char rate[16], used[16], cap[16];
+
+	fcntl(fdIn, F_SETFL, fcntl(fdIn, F_GETFL) | O_NONBLOCK);
+	fcntl(fdOut, F_SETFL, fcntl(fdOut, F_GETFL) | O_NONBLOCK);
+	capacity = fcntl(fdIn, F_GETPIPE_SZ) + fcntl(fdOut, F_GETPIPE_SZ);
+
+	for (;;)
+	{
+		struct pollfd fds[2] = { { fdIn, POLLIN, 0 }, { fdOut, POLLOUT, 0 } };
+		long long now = nowMs();
+		int timeout = (int)(lastReport + meterMs - now);
+		ssize_t n = 0;
+
+		if (timeout <= 0)
+		{
+			int upstream = 0, downstream = 0;
+			const char *state = "flowing";
+
+			ioctl(fdIn, FIONREAD, &upstream);
+			ioctl(fdOut, FIONREAD, &downstream);
+			if (upstream >= fcntl(fdIn, F_GETPIPE_SZ))
+			{
+				state = "writer-blocked";
+			}
+			else if (upstream == 0 && downstream == 0)
+			{
+				state = "reader-blocked";
+			}
+
+			fprintf(stderr, "edge %d (%s -> %s): %s/s, %s/%s buffered, %s\n", edge, from, to,
+				humanBytes(sinceReport * 1000.0 / (now - lastReport), rate, sizeof(rate)),
+				humanBytes(upstream + downstream, used, sizeof(used)),
+				humanBytes(capacity, cap, sizeof(cap)), state);
+			sinceReport = 0;
+			lastReport = now;
+			continue;
+		}
+
+		/* Wait until data is available and the consumer has room for it */
+		fds[1].fd = -1;
+		if (poll(fds, 2, timeout) <= 0)
+		{
+			continue;
+		}
+		if (fds[0].revents & (POLLIN | POLLHUP))
+		{
+			fds[0].fd = -1;
+			fds[1].fd = fdOut;
+			if (poll(fds, 2, timeout) <= 0)
+			{
+				continue;
+			}
+			if (fds[1].revents & (POLLERR | POLLHUP))
+			{
+				break;	// Consumer is gone
+			}
+			n = splice(fdIn, NULL, fdOut, NULL, 1 << 20, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n == 0)
+			{
+				break;	// Producer is done
+			}
+			if (n < 0 && errno != EAGAIN)
+			{
+				perror("splice");
+				break;
+			}
+		}
+		if (n > 0)
+		{
+			total += n;
+			sinceReport += n;
+		}
+	}
+
+	fprintf(stderr, "edge %d (%s -> %s): %s total, %s/s average\n", edge, from, to,
+		humanBytes(total, used, sizeof(used)),
+		humanBytes(total * 1000.0 / (nowMs() - start + 1), rate, sizeof(rate)));
+}
+
+/***********************************************************
+ *  Parses a size such as 4096, 64K, 512M or 2G
+ **********************************************************/
+static long long parseSize(const char *str)
+{
+	char *end;
+	long long size = strtoll(str, &end, 10);
+
+	switch (*end)
+	{
+	case 'G': case 'g': size <<= 10;	// fall through
+	case 'M': case 'm': size <<= 10;	// fall through
+	case 'K': case 'k': size <<= 10;
+		end++;
+		break;
+	}
+
+	return (*end || size <= 0) ? -1 : size;
+}
+
+/***********************************************************
+ *  Sets O_NONBLOCK on fd if it is a pipe. Terminals and
+ *  files are shared with the shell and are left alone
+ **********************************************************/
+static int nonblockIfPipe(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == -1 || !S_ISFIFO(st.st_mode))
+	{
+		return 0;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return 1;
+}
+
+/***********************************************************
+ *  buf SIZE [memfd | file]
+ *  Elastic buffer stage. Soaks up to SIZE bytes from a bursty
+ *  producer in a ring buffer so the producer keeps running
+ *  while the consumer pauses. With a spill target, data that
+ *  does not fit in the ring goes to a memfd or file instead
+ *  of pushing back on the producer. The spill is filled and
+ *  drained with splice, and while nothing is buffered pipe to
+ *  pipe data is spliced straight through. The ring is filled
+ *  and drained with read() and write(): vmsplice would hand
+ *  the consumer references to ring pages that get reused. The
+ *  high-water mark is reported on stderr when the stage exits
+ **********************************************************/
+int runBufferStage(CMD *cmd)
+{
+	long long capacity = 64LL << 20;
+	long long head = 0, used = 0;	// Ring read position and bytes held
+	loff_t spillIn = 0, spillOut = 0;	// Spill write and read offsets
+	long long highWater = 0, spilled = 0;
+	int spillFd = -1;
+	int eof = 0, inPipe, outPipe;
+	int status = EXIT_SUCCESS;
+	char *ring;
+	char bounce[1 << 16];	// Spill copies when splice cannot be used
+	char hw[16], sp[16];
+
+	if (cmd->argv[1] && (capacity = parseSize(cmd->argv[1])) == -1)
+	{
+		fprintf(stderr, "buf: bad size %s\n", cmd->argv[1]);
+		return EX_USAGE;
+	}
+
+	if (cmd->argv[1] && cmd->argv[2])
+	{
+		if (strcmp(cmd->argv[2], "memfd") == 0)
+		{
+			spillFd = memfd_create("buf-spill", MFD_CLOEXEC);
+		}
+		else
+		{
+			spillFd = open(cmd->argv[2], O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		}
+
+		if (spillFd == -1)
+		{
+			perror(cmd->argv[2]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* Pages are only touched as the ring fills up */
+	ring = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (ring == MAP_FAILED)
+	{
+		perror("buf");
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	inPipe = nonblockIfPipe(STDIN_FILENO);
+	outPipe = nonblockIfPipe(STDOUT_FILENO);
+
+	while (!eof || used > 0 || spillOut < spillIn)
+	{
+		struct pollfd fds[2] = { { -1, POLLIN, 0 }, { -1, POLLOUT, 0 } };
+		int spilling = spillOut < spillIn || used == capacity;
+		ssize_t n;
+
+		if (!eof && (used < capacity || spillFd != -1))
+		{
+			fds[0].fd = STDIN_FILENO;
+		}
+		if (used > 0 || spillOut < spillIn)
+		{
+			fds[1].fd = STDOUT_FILENO;
+		}
+
+		if (poll(fds, 2, -1) == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			perror("poll");
+			status = EXIT_FAILURE;
+			break;
+		}
+
+		/* Take in as much as we can. Once anything has spilled, everything
+			after it spills too so the output stays in order */
+		if (fds[0].revents)
+		{
+			n = -1;
+			errno = EAGAIN;
+
+			/* With nothing held back, pipe to pipe data goes straight through
+				with splice and is never copied. Once the consumer's pipe is full
+				this fails with EAGAIN and the data is buffered as usual */
+			if (!spilling && used == 0 && inPipe && outPipe)
+			{
+				n = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, 1 << 20, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (n == -1 && errno == EPIPE)
+				{
+					break;	// Consumer is gone
+				}
+			}
+
+			if (n == -1 && errno == EAGAIN && spilling && spillFd != -1)
+			{
+				if (inPipe)
+				{
+					n = splice(STDIN_FILENO, NULL, spillFd, &spillIn, 1 << 20, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				}
+				else if ((n = read(STDIN_FILENO, bounce, sizeof(bounce))) > 0)
+				{
+					n = pwrite(spillFd, bounce, n, spillIn);
+					spillIn += n > 0 ? n : 0;
+				}
+				if (n > 0)
+				{
+					spilled += n;
+				}
+			}
+			else if (n == -1 && errno == EAGAIN)
+			{
+				long long tail = (head + used) % capacity;
+				long long room = (tail >= head && used < capacity) ? capacity - tail : head - tail;
+
+				n = read(STDIN_FILENO, ring + tail, room);
+				if (n > 0)
+				{
+					used += n;
+				}
+			}
+
+			if (n == 0)
+			{
+				eof = 1;
+			}
+			else if (n == -1 && errno != EAGAIN && errno != EINTR)
+			{
+				perror("buf: read");
+				status = EXIT_FAILURE;
+				eof = 1;
+			}
+
+			if (used + spillIn - spillOut > highWater)
+			{
+				highWater = used + spillIn - spillOut;
+			}
+		}
+
+		/* Hand out the oldest data first, the ring is always older than the spill */
+		if (fds[1].revents & (POLLERR | POLLHUP))
+		{
+			break;	// Consumer is gone
+		}
+		if (fds[1].revents)
+		{
+			if (used > 0)
+			{
+				long long chunk = (head + used > capacity) ? capacity - head : used;
+
+				n = write(STDOUT_FILENO, ring + head, chunk);
+				if (n > 0)
+				{
+					head = (head + n) % capacity;
+					used -= n;
+				}
+			}
+			else
+			{
+				if (outPipe)
+				{
+					n = splice(spillFd, &spillOut, STDOUT_FILENO, NULL, 1 << 20, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				}
+				else if ((n = pread(spillFd, bounce, sizeof(bounce), spillOut)) > 0)
+				{
+					n = write(STDOUT_FILENO, bounce, n);
+					spillOut += n > 0 ? n : 0;
+				}
+
+				/* Give the spill space back once it has been drained */
+				if (spillOut == spillIn && spillIn > 0)
+				{
+					spillIn = spillOut = 0;
+					if (ftruncate(spillFd, 0) == -1)
+					{
+						perror("buf: ftruncate");
+					}
+				}
+			}
+
+			if (n == -1 && errno != EAGAIN && errno != EINTR)
+			{
+				if (errno != EPIPE)
+				{
+					perror("buf: write");
+					status = EXIT_FAILURE;	// What the ring still held is lost
+				}
+				break;
+			}
+		}
+	}
+
+	fprintf(stderr, "buf: high-water %s, ring %s, %s spilled\n", humanBytes(highWater, hw, sizeof(hw)),
+		cmd->argv[1] ? cmd->argv[1] : "64M", humanBytes(spilled, sp, sizeof(sp)));
+	munmap(ring, capacity);
+
+	return status;
+}
+
+/***********************************************************
+ *  Result cache (-c)
+ *  A pipeline whose last stage writes to a '>' file can be
+ *  memoized. The key covers the working directory, each
+ *  stage's argv, the identity of the binary it resolves to
+ *  and the identity of every '<' input, so changing any of
+ *  those misses. Entries are files named by the key, evicted
+ *  oldest first once the cache grows past its size limit.
+ *  Only '<' inputs are tracked; files named as arguments are
+ *  not, so only use -c for pipelines that read through '<'
+ **********************************************************/
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/***********************************************************
+ *  Folds bytes into a 64 bit FNV-1a hash
+ **********************************************************/
+static unsigned long long fnvHash(unsigned long long hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--)
+	{
+		hash = (hash ^ *p++) * FNV_PRIME;
+	}
+
+	return hash;
+}
+
+/***********************************************************
+ *  Folds the identity of a file (device, inode, size and
+ *  modification time) into the hash
+ **********************************************************/
+static unsigned long long hashIdentity(unsigned long long hash, const struct stat *st)
+{
+	hash = fnvHash(hash, &st->st_dev, sizeof(st->st_dev));
+	hash = fnvHash(hash, &st->st_ino, sizeof(st->st_ino));
+	hash = fnvHash(hash, &st->st_size, sizeof(st->st_size));
+	hash = fnvHash(hash, &st->st_mtim, sizeof(st->st_mtim));
+
+	return hash;
+}
+
+/***********************************************************
+ *  Finds the binary execvp() would run for name
+ **********************************************************/
+static int resolveBinary(const char *name, struct stat *st)
+{
+	char path[PATH_MAX];
+	const char *dirs = getenv("PATH");
+
+	if (strchr(name, '/'))
+	{
+		return stat(name, st);
+	}
+
+	while (dirs && *dirs)
+	{
+		size_t len = strcspn(dirs, ":");
+
+		snprintf(path, sizeof(path), "%.*s/%s", (int)len, len ? dirs : ".", name);
+		if (access(path, X_OK) == 0 && stat(path, st) == 0)
+		{
+			return 0;
+		}
+		dirs += len + (dirs[len] == ':');
+	}
+
+	return -1;
+}
+
+/***********************************************************
+ *  A pipeline is cacheable when only its last stage writes
+ *  to a file, that file is a regular file, and every '<'
+ *  input is a regular file. The first stage has to read a
+ *  regular file too, either from '<' or from the shell's own
+ *  stdin, since whatever it reads goes into the key
+ **********************************************************/
+int isCacheable(CMD *cmds, int numCmds)
+{
+	struct stat st;
+	int i;
+
+	if (fstat(cmds[0].fdIn, &st) == -1 || !S_ISREG(st.st_mode))
+	{
+		return 0;
+	}
+
+	for (i = 0; i < numCmds; i++)
+	{
+		if (cmds[i].fdIn != STDIN_FILENO && (fstat(cmds[i].fdIn, &st) == -1 || !S_ISREG(st.st_mode)))
+		{
+			return 0;
+		}
+		if (cmds[i].fdOut != STDOUT_FILENO && i != numCmds - 1)
+		{
+			return 0;
+		}
+	}
+
+	return cmds[numCmds - 1].fdOut != STDOUT_FILENO
+		&& fstat(cmds[numCmds - 1].fdOut, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/***********************************************************
+ *  Computes the cache key of a pipeline
+ **********************************************************/
+static unsigned long long cacheKey(CMD *cmds, int numCmds)
+{
+	unsigned long long hash = FNV_OFFSET;
+	char cwd[PATH_MAX];
+	struct stat st;
+	int i, j;
+
+	if (getcwd(cwd, sizeof(cwd)))
+	{
+		hash = fnvHash(hash, cwd, strlen(cwd) + 1);
+	}
+
+	for (i = 0; i < numCmds; i++)
+	{
+		hash = fnvHash(hash, "|", 1);
+		for (j = 0; cmds[i].argv[j]; j++)
+		{
+			hash = fnvHash(hash, cmds[i].argv[j], strlen(cmds[i].argv[j]) + 1);
+		}
+
+		/* Builtins have no binary, their name is enough */
+		if (resolveBinary(cmds[i].argv[0], &st) == 0)
+		{
+			hash = hashIdentity(hash, &st);
+		}
+		if (cmds[i].fdIn != STDIN_FILENO && fstat(cmds[i].fdIn, &st) == 0)
+		{
+			hash = fnvHash(hash, "<", 1);
+			hash = hashIdentity(hash, &st);
+		}
+	}
+
+	/* Without '<' the first stage reads the shell's stdin from its current offset */
+	if (cmds[0].fdIn == STDIN_FILENO && fstat(STDIN_FILENO, &st) == 0)
+	{
+		off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+
+		hash = fnvHash(hash, "0", 1);
+		hash = hashIdentity(hash, &st);
+		hash = fnvHash(hash, &offset, sizeof(offset));
+	}
+
+	return hash;
+}
+
+/***********************************************************
+ *  Copies all of src from the start into dst, returns the
+ *  number of bytes copied or -1
+ **********************************************************/
+static long long copyFile(int src, int dst)
+{
+	long long total = 0;
+	loff_t off = 0;
+	ssize_t n;
+
+	while ((n = copy_file_range(src, &off, dst, NULL, 1 << 30, 0)) > 0)
+	{
+		total += n;
+	}
+	if (n == 0)
+	{
+		return total;
+	}
+
+	/* Different filesystems on old kernels, copy by hand */
+	if (errno == EXDEV || errno == EINVAL || errno == ENOSYS)
+	{
+		char buf[1 << 16];
+
+		while ((n = pread(src, buf, sizeof(buf), off)) > 0)
+		{
+			if (write(dst, buf, n) != n)
+			{
+				return -1;
+			}
+			off += n;
+			total += n;
+		}
+		return n == 0 ? total : -1;
+	}
+
+	return -1;
+}
+
+/***********************************************************
+ *  Adds to the hit, miss and saved byte counters kept in the
+ *  cache directory and prints the totals
+ **********************************************************/
+static void cacheStats(const char *cacheDir, int hit, long long saved)
+{
+	char path[PATH_MAX];
+	char size[16];
+	long long hits = 0, misses = 0, totalSaved = 0;
+	FILE *fp;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/stats", cacheDir);
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+	{
+		perror(path);
+		return;
+	}
+
+	/* Other shells may share the cache */
+	flock(fd, LOCK_EX);
+	fp = fdopen(fd, "r+");
+	if (fscanf(fp, "%lld %lld %lld", &hits, &misses, &totalSaved) != 3)
+	{
+		hits = misses = totalSaved = 0;
+	}
+	hits += hit;
+	misses += !hit;
+	totalSaved += saved;
+	rewind(fp);
+	fprintf(fp, "%lld %lld %lld\n", hits, misses, totalSaved);
+	fflush(fp);
+	flock(fd, LOCK_UN);
+	fclose(fp);
+
+	fprintf(stderr, "cache: %s (%lld hits, %lld misses, %s saved)\n", hit ? "hit" : "miss",
+		hits, misses, humanBytes(totalSaved, size, sizeof(size)));
+}
+
+/***********************************************************
+ *  Removes the least recently used entries until the cache
+ *  fits in its limit. Hits touch an entry's mtime
+ **********************************************************/
+typedef struct cacheEntry
+{
+	char name[32];
+	long long size;
+	struct timespec mtime;
+
+} CacheEntry;
+
+static int olderEntry(const void *a, const void *b)
+{
+	const struct timespec *x = &((const CacheEntry *)a)->mtime;
+	const struct timespec *y = &((const CacheEntry *)b)->mtime;
+
+	if (x->tv_sec != y->tv_sec)
+	{
+		return x->tv_sec < y->tv_sec ? -1 : 1;
+	}
+	return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+static void cacheEvict(const char *cacheDir, long long limit)
+{
+	DIR *dir = opendir(cacheDir);
+	CacheEntry *entries = NULL;
+	struct dirent *de;
+	struct stat st;
+	long long total = 0;
+	int numEntries = 0, capacity = 0;
+	int i;
+
+	if (!dir)
+	{
+		return;
+	}
+
+	while ((de = readdir(dir)) != NULL)
+	{
+		/* Entries are named by their 16 digit key */
+		if (strlen(de->d_name) != 16 || fstatat(dirfd(dir), de->d_name, &st, 0) == -1)
+		{
+			continue;
+		}
+		if (numEntries == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 64;
+			if (!(entries = realloc(entries, sizeof(CacheEntry) * capacity)))
+			{
+				fprintf(stderr, "Buffer allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		strcpy(entries[numEntries].name, de->d_name);
+		entries[numEntries].size = st.st_size;
+		entries[numEntries].mtime = st.st_mtim;
+		total += st.st_size;
+		numEntries++;
+	}
+
+	qsort(entries, numEntries, sizeof(CacheEntry), olderEntry);
+	for (i = 0; i < numEntries && total > limit; i++)
+	{
+		if (unlinkat(dirfd(dir), entries[i].name, 0) == 0)
+		{
+			total -= entries[i].size;
+		}
+	}
+
+	free(entries);
+	closedir(dir);
+}
+
+/***********************************************************
+ *  Runs a cacheable pipeline. On a hit the stored output is
+ *  copied into the '>' file and nothing runs. On a miss the
+ *  pipeline runs in a child with its output going to a new
+ *  cache file, which is copied into the '>' file and kept if
+ *  the pipeline succeeded. Either way the shell carries on
+ **********************************************************/
+void cachedPipeline(CMD *cmds, int numPipes, int numCmds, int meterMs, const char *cacheDir, long long limit)
+{
+	CMD *last = &cmds[numCmds - 1];
+	char entry[PATH_MAX], temp[PATH_MAX];
+	int cached, status, i;
+	long long bytes;
+	struct stat st;
+	pid_t pid;
+
+	snprintf(entry, sizeof(entry), "%s/%016llx", cacheDir, cacheKey(cmds, numCmds));
+
+	if ((cached = open(entry, O_RDONLY | O_CLOEXEC)) != -1)
+	{
+		if ((bytes = copyFile(cached, last->fdOut)) == -1)
+		{
+			perror(entry);
+		}
+		else
+		{
+			futimens(cached, NULL);	// Mark it recently used
+			cacheStats(cacheDir, 1, bytes);
+		}
+		close(cached);
+	}
+	else
+	{
+		int realOut = last->fdOut;
+
+		snprintf(temp, sizeof(temp), "%s/tmp.XXXXXX", cacheDir);
+		if ((cached = mkostemp(temp, O_CLOEXEC)) == -1)
+		{
+			perror(temp);
+			return;
+		}
+
+		if ((pid = fork()) == -1)
+		{
+			perror("fork");
+			exit(EXIT_FAILURE);
+		}
+		if (pid == 0)
+		{
+			closeFD(realOut);
+			last->fdOut = cached;
+			pipeline(cmds, numPipes, numCmds, meterMs);
+			exit(EXIT_FAILURE);	// Only reached if the last stage could not run
+		}
+
+		waitpid(pid, &status, 0);
+		if (copyFile(cached, realOut) == -1)
+		{
+			perror("cache copy");
+		}
+		cacheStats(cacheDir, 0, 0);	// Every miss counts, stored or not
+
+		/* Only keep output from a pipeline that succeeded, and never an entry
+		that alone is over the limit, since evicting for it would empty the cache */
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0
+			&& fstat(cached, &st) == 0 && st.st_size <= limit
+			&& rename(temp, entry) == 0)
+		{
+			cacheEvict(cacheDir, limit);
+		}
+		else
+		{
+			unlink(temp);
+		}
+		close(cached);
+	}
+
+	/* The shell keeps running, so it has to close the redirections itself */
+	for (i = 0; i < numCmds; i++)
+	{
+		if (cmds[i].fdIn != STDIN_FILENO)
+		{
+			close(cmds[i].fdIn);
+		}
+		if (cmds[i].fdOut != STDOUT_FILENO)
+		{
+			close(cmds[i].fdOut);
+		}
+	}
+}
+
+/***********************************************************
+ *  Asynchronous file output
+ *  Builtin stages that write to files (tee's files, and the
+ *  end of a fused run redirected with '>') go through an
+ *  async sink. Output is gathered into SINK_BUF_SIZE buffers
+ *  and each full buffer is queued on an io_uring as a write
+ *  at its file offset, so up to SINK_BUFS writes per file are
+ *  in flight while the stage keeps producing. The stage only
+ *  waits when every buffer of a file is still being written.
+ *  Without io_uring (old kernel, or disabled) full buffers are
+ *  written with plain pwrite(). With -D files are written with
+ *  O_DIRECT from page aligned buffers, bypassing the page
+ *  cache; the unaligned tail goes through the cache at close.
+ *  Pipes, terminals and files opened for appending ('>>',
+ *  tee -a) are always written directly
+ **********************************************************/
+#define SINK_BUFS 4
+#define SINK_BUF_SIZE (1 << 20)
+#define SINK_ALIGN 4096
+#define URING_ENTRIES 64
+
+int directIo = 0;	// -D
+
+static int writeAll(int, const char *, size_t);
+
+typedef struct sinkBuf
+{
+	struct asyncSink *sink;
+	char *data;
+	size_t len;
+	off_t offset;
+	int busy;	// Queued on the ring and not completed yet
+
+} SinkBuf;
+
+typedef struct asyncSink
+{
+	int fd;
+	int async;	// Regular file written through buffers
+	int direct;	// O_DIRECT is set on fd
+	int error;
+	off_t offset;	// Where the next buffer goes in the file
+	SinkBuf bufs[SINK_BUFS];
+	int cur;	// Buffer being filled
+
+} AsyncSink;
+
+typedef struct uring
+{
+	int fd;	// -1 until set up, -2 if io_uring is not available
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned inFlight;
+
+} Uring;
+
+static Uring ring = { .fd = -1 };
+
+/***********************************************************
+ *  Sets up the io_uring the first time a sink needs it.
+ *  Returns 0 if io_uring cannot be used
+ **********************************************************/
+static int uringInit(void)
+{
+	struct io_uring_params params;
+	size_t sqLen, cqLen;
+	char *sq, *cq;
+
+	if (ring.fd != -1)
+	{
+		return ring.fd >= 0;
+	}
+	ring.fd = -2;
+
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (fd == -1)
+	{
+		return 0;
+	}
+
+	sqLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		sqLen = cqLen = sqLen > cqLen ? sqLen : cqLen;
+	}
+
+	sq = mmap(NULL, sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	cq = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq
+		: mmap(NULL, cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || ring.sqes == MAP_FAILED)
+	{
+		close(fd);
+		return 0;
+	}
+
+	ring.sqHead = (unsigned *)(sq + params.sq_off.head);
+	ring.sqTail = (unsigned *)(sq + params.sq_off.tail);
+	ring.sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring.sqArray = (unsigned *)(sq + params.sq_off.array);
+	ring.cqHead = (unsigned *)(cq + params.cq_off.head);
+	ring.cqTail = (unsigned *)(cq + params.cq_off.tail);
+	ring.cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	ring.fd = fd;
+
+	return 1;
+}
+
+/***********************************************************
+ *  Handles finished writes. Waits for at least one if wait
+ *  is set and anything is in flight
+ **********************************************************/
+static void uringReap(int wait)
+{
+	unsigned head;
+
+	if (wait && ring.inFlight > 0
+		&& syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR)
+	{
+		perror("io_uring_enter");
+	}
+
+	head = *ring.cqHead;
+	while (head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE))
+	{
+		struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+		SinkBuf *buf = (SinkBuf *)(uintptr_t)cqe->user_data;
+
+		/* Finish a short write by hand */
+		if (cqe->res >= 0 && (size_t)cqe->res < buf->len)
+		{
+			ssize_t rest = pwrite(buf->sink->fd, buf->data + cqe->res, buf->len - cqe->res, buf->offset + cqe->res);
+
+			if (rest != (ssize_t)(buf->len - cqe->res))
+			{
+				buf->sink->error = rest == -1 ? errno : EIO;
+			}
+		}
+		else if (cqe->res < 0)
+		{
+			buf->sink->error = -cqe->res;
+		}
+
+		buf->busy = 0;
+		ring.inFlight--;
+		head++;
+	}
+	__atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+}
+
+/***********************************************************
+ *  Queues a write of buf at its offset
+ **********************************************************/
+static void uringWrite(SinkBuf *buf)
+{
+	unsigned tail = *ring.sqTail;
+	unsigned idx = tail & *ring.sqMask;
+	struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+	/* Never queue more than the completion ring can hold */
+	while (ring.inFlight >= URING_ENTRIES)
+	{
+		uringReap(1);
+	}
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = buf->sink->fd;
+	sqe->addr = (uintptr_t)buf->data;
+	sqe->len = buf->len;
+	sqe->off = buf->offset;
+	sqe->user_data = (uintptr_t)buf;
+	ring.sqArray[idx] = idx;
+	__atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	buf->busy = 1;
+	ring.inFlight++;
+	if (syscall(__NR_io_uring_enter, ring.fd, 1, 0, 0, NULL, 0) == -1)
+	{
+		perror("io_uring_enter");
+	}
+}
+
+/***********************************************************
+ *  Starts a sink on fd. Returns -1 if buffers could not be
+ *  allocated, fd is then written directly
+ **********************************************************/
+static int sinkOpen(AsyncSink *sink, int fd)
+{
+	struct stat st;
+	int i, flags;
+
+	memset(sink, 0, sizeof(*sink));
+	sink->fd = fd;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+	{
+		return 0;
+	}
+
+	/* Writes carry their own offsets, which would overwrite whatever other
+		appenders add meanwhile, so O_APPEND files are written directly. The
+		file position is where the stage would have written next */
+	if ((flags = fcntl(fd, F_GETFL)) == -1 || (flags & O_APPEND))
+	{
+		return 0;
+	}
+	if ((sink->offset = lseek(fd, 0, SEEK_CUR)) == -1)
+	{
+		return 0;
+	}
+
+	for (i = 0; i < SINK_BUFS; i++)
+	{
+		sink->bufs[i].sink = sink;
+		if (posix_memalign((void **)&sink->bufs[i].data, SINK_ALIGN, SINK_BUF_SIZE) != 0)
+		{
+			while (i-- > 0)
+			{
+				free(sink->bufs[i].data);
+			}
+			return -1;
+		}
+	}
+
+	if (directIo && sink->offset % SINK_ALIGN == 0 && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == 0)
+	{
+		sink->direct = 1;
+	}
+	sink->async = 1;
+	uringInit();
+
+	return 0;
+}
+
+/***********************************************************
+ *  Sends the buffer being filled to the file and moves on to
+ *  the next one, waiting for it if it is still in flight
+ **********************************************************/
+static void sinkFlush(AsyncSink *sink)
+{
+	SinkBuf *buf = &sink->bufs[sink->cur];
+
+	if (buf->len == 0)
+	{
+		return;
+	}
+	buf->offset = sink->offset;
+	sink->offset += buf->len;
+
+	if (ring.fd >= 0)
+	{
+		uringWrite(buf);
+	}
+	else if (pwrite(sink->fd, buf->data, buf->len, buf->offset) != (ssize_t)buf->len)
+	{
+		sink->error = errno ? errno : EIO;
+	}
+
+	sink->cur = (sink->cur + 1) % SINK_BUFS;
+	while (sink->bufs[sink->cur].busy)
+	{
+		uringReap(1);
+	}
+	sink->bufs[sink->cur].len = 0;
+}
+
+/***********************************************************
+ *  Writes data to the sink, returns -1 on failure
+ **********************************************************/
+static int sinkWrite(AsyncSink *sink, const char *data, size_t len)
+{
+	if (!sink->async)
+	{
+		return writeAll(sink->fd, data, len);
+	}
+
+	while (len > 0 && !sink->error)
+	{
+		SinkBuf *buf = &sink->bufs[sink->cur];
+		size_t room = SINK_BUF_SIZE - buf->len;
+		size_t n = len < room ? len : room;
+
+		memcpy(buf->data + buf->len, data, n);
+		buf->len += n;
+		data += n;
+		len -= n;
+
+		if (buf->len == SINK_BUF_SIZE)
+		{
+			sinkFlush(sink);
+		}
+		if (ring.fd >= 0)
+		{
+			uringReap(0);
+		}
+	}
+
+	/* The write failed in a completion or an earlier flush, errno is long gone */
+	if (sink->error)
+	{
+		errno = sink->error;
+		return -1;
+	}
+	return 0;
+}
+
+/***********************************************************
+ *  Writes what is left, waits for the writes in flight and
+ *  leaves the file position at the end of the output
+ **********************************************************/
+static int sinkClose(AsyncSink *sink)
+{
+	SinkBuf *buf;
+	int i;
+
+	if (!sink->async)
+	{
+		return 0;
+	}
+
+	/* O_DIRECT needs whole blocks, the tail goes through the page cache */
+	buf = &sink->bufs[sink->cur];
+	if (sink->direct && buf->len % SINK_ALIGN)
+	{
+		for (i = 0; i < SINK_BUFS; i++)
+		{
+			while (sink->bufs[i].busy)
+			{
+				uringReap(1);
+			}
+		}
+		fcntl(sink->fd, F_SETFL, fcntl(sink->fd, F_GETFL) & ~O_DIRECT);
+		sink->direct = 0;
+	}
+	sinkFlush(sink);
+
+	for (i = 0; i < SINK_BUFS; i++)
+	{
+		while (sink->bufs[i].busy)
+		{
+			uringReap(1);
+		}
+		free(sink->bufs[i].data);
+	}
+	if (sink->direct)
+	{
+		fcntl(sink->fd, F_SETFL, fcntl(sink->fd, F_GETFL) & ~O_DIRECT);
+	}
+	lseek(sink->fd, sink->offset, SEEK_SET);
+	sink->async = 0;
+
+	if (sink->error)
+	{
+		errno = sink->error;
+		return -1;
+	}
+	return 0;
+}
+
+/***********************************************************
+ *  Stage fusion
+ *  cat, grep -F, head and tee have builtin versions. When two or
+ *  more of them are next to each other in a pipeline they run
+ *  in one process as a chain of filters: each stage hands
+ *  batches straight to the next, data only crosses the kernel
+ *  where the run meets an external command, and once head has
+ *  its lines everything upstream of it stops reading
+ **********************************************************/
+#define FUSED_BATCH (1 << 17)
+
+/***********************************************************
+ *  Returns the head -n line count of a head stage, or -1 if
+ *  the arguments are not ones the builtin understands
+ **********************************************************/
+static long long headLines(CMD *cmd)
+{
+	char **argv = cmd->argv;
+	char *end;
+	long long lines = 10;
+
+	if (argv[1] && strcmp(argv[1], "-n") == 0 && argv[2] && !argv[3])
+	{
+		lines = strtoll(argv[2], &end, 10);
+	}
+	else if (argv[1] && strncmp(argv[1], "-n", 2) == 0 && !argv[2])
+	{
+		lines = strtoll(argv[1] + 2, &end, 10);
+	}
+	else if (argv[1] && argv[1][0] == '-' && !argv[2])
+	{
+		lines = strtoll(argv[1] + 1, &end, 10);
+	}
+	else
+	{
+		return argv[1] ? -1 : lines;
+	}
+
+	return (*end || lines < 0) ? -1 : lines;
+}
+
+/***********************************************************
+ *  Whether a stage has a builtin version. cat only takes
+ *  file arguments when it is the first stage of the run
+ **********************************************************/
+static int isFusible(CMD *cmd, int first)
+{
+	char **argv = cmd->argv;
+	int j;
+
+	if (strcmp(argv[0], "cat") == 0)
+	{
+		for (j = 1; argv[j]; j++)
+		{
+			if (argv[j][0] == '-' || !first)
+			{
+				return 0;
+			}
+		}
+		return 1;
+	}
+	if (strcmp(argv[0], "grep") == 0)
+	{
+		return argv[1] && strcmp(argv[1], "-F") == 0 && argv[2] && !argv[3];
+	}
+	if (strcmp(argv[0], "head") == 0)
+	{
+		return headLines(cmd) >= 0;
+	}
+	if (strcmp(argv[0], "tee") == 0)
+	{
+		for (j = 1; argv[j]; j++)
+		{
+			if (argv[j][0] == '-' && !(j == 1 && strcmp(argv[j], "-a") == 0))
+			{
+				return 0;
+			}
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+/***********************************************************
+ *  Returns the last stage of the fused run starting at
+ *  start, which is start itself when nothing can be fused.
+ *  Redirections can only be at the ends of a run
+ **********************************************************/
+int fusedRunEnd(CMD *cmds, int start, int numCmds)
+{
+	int end = start;
+
+	if (!isFusible(&cmds[start], 1))
+	{
+		return start;
+	}
+
+	while (end + 1 < numCmds && cmds[end].fdOut == STDOUT_FILENO
+		&& cmds[end + 1].fdIn == STDIN_FILENO && isFusible(&cmds[end + 1], 0))
+	{
+		end++;
+	}
+
+	return end;
+}
+
+/***********************************************************
+ *  Writes everything, returns -1 on failure
+ **********************************************************/
+static int writeAll(int fd, const char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = write(fd, buf, len);
+
+		if (n == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/***********************************************************
+ *  Sink at the end of the chain, batches the writes made for
+ *  one read into one write to stdout. A terminal gets each
+ *  write as it comes, and a file on stdout an async sink
+ **********************************************************/
+static int sinkPush(Filter *f, const char *data, size_t len)
+{
+	if (f->files)
+	{
+		return sinkWrite(f->files, data, len) == -1;
+	}
+
+	if (f->carryLen + len > f->carryCap)
+	{
+		if (writeAll(STDOUT_FILENO, f->carry, f->carryLen) == -1)
+		{
+			return 1;
+		}
+		f->carryLen = 0;
+
+		if (len >= f->carryCap)
+		{
+			return writeAll(STDOUT_FILENO, data, len) == -1;
+		}
+	}
+	memcpy(f->carry + f->carryLen, data, len);
+	f->carryLen += len;
+
+	return 0;
+}
+
+/***********************************************************
+ *  Writes out what the sink is holding, returns -1 on failure
+ **********************************************************/
+static int sinkDrain(Filter *f)
+{
+	int err = writeAll(STDOUT_FILENO, f->carry, f->carryLen);
+
+	f->carryLen = 0;
+	return err;
+}
+
+static int sinkFinish(Filter *f)
+{
+	int err = sinkDrain(f);
+
+	if (f->files && sinkClose(f->files) == -1)
+	{
+		perror("write");
+		err = -1;
+	}
+	return err;
+}
+
+/***********************************************************
+ *  cat in the middle of a run passes its input through
+ **********************************************************/
+static int catPush(Filter *f, const char *data, size_t len)
+{
+	return f->next->push(f->next, data, len);
+}
+
+static int noFinish(Filter *f)
+{
+	return 0;
+}
+
+/***********************************************************
+ *  Appends data to the partial line held by a filter
+ **********************************************************/
+static void carryAppend(Filter *f, const char *data, size_t len)
+{
+	if (f->carryLen + len > f->carryCap)
+	{
+		f->carryCap = (f->carryLen + len) * 2;
+		if (!(f->carry = realloc(f->carry, f->carryCap)))
+		{
+			fprintf(stderr, "Buffer allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memcpy(f->carry + f->carryLen, data, len);
+	f->carryLen += len;
+}
+
+/***********************************************************
+ *  grep -F: passes on the lines that contain the pattern.
+ *  The batch is searched for the pattern first and lines are
+ *  only delimited around a match
+ **********************************************************/
+static int grepLine(Filter *f, const char *line, size_t len)
+{
+	if (memmem(line, len, f->pattern, f->patternLen))
+	{
+		f->status = 0;
+		return f->next->push(f->next, line, len);
+	}
+
+	return 0;
+}
+
+static int grepPush(Filter *f, const char *data, size_t len)
+{
+	const char *end = data + len;
+	const char *nl, *hit;
+
+	/* Finish the line left over from the last batch */
+	if (f->carryLen)
+	{
+		if (!(nl = memchr(data, '\n', len)))
+		{
+			carryAppend(f, data, len);
+			return 0;
+		}
+		carryAppend(f, data, nl + 1 - data);
+		data = nl + 1;
+		if (grepLine(f, f->carry, f->carryLen))
+		{
+			return 1;
+		}
+		f->carryLen = 0;
+	}
+
+	while (data < end && (hit = memmem(data, end - data, f->pattern, f->patternLen)) != NULL)
+	{
+		const char *start = hit;
+
+		while (start > data && start[-1] != '\n')
+		{
+			start--;
+		}
+		if (!(nl = memchr(hit, '\n', end - hit)))
+		{
+			break;	// Match in the partial line at the end
+		}
+		f->status = 0;
+		if (f->next->push(f->next, start, nl + 1 - start))
+		{
+			return 1;
+		}
+		data = nl + 1;
+	}
+
+	/* Hold the partial line at the end of the batch */
+	if (data < end)
+	{
+		const char *tail = (nl = memrchr(data, '\n', end - data)) ? nl + 1 : data;
+
+		carryAppend(f, tail, end - tail);
+	}
+
+	return 0;
+}
+
+static int grepFinish(Filter *f)
+{
+	int done = 0;
+
+	/* A last line without a newline still gets one on output */
+	if (f->carryLen)
+	{
+		carryAppend(f, "\n", 1);
+		done = grepLine(f, f->carry, f->carryLen);
+		f->carryLen = 0;
+	}
+
+	return done;
+}
+
+/***********************************************************
+ *  head -n: passes on the first lines and then reports that
+ *  it is done, which stops everything upstream
+ **********************************************************/
+static int headPush(Filter *f, const char *data, size_t len)
+{
+	const char *p = data, *end = data + len;
+
+	while (f->lines > 0 && (p = memchr(p, '\n', end - p)) != NULL)
+	{
+		p++;
+		f->lines--;
+	}
+
+	if (f->lines == 0)
+	{
+		f->next->push(f->next, data, (p ? p : end) - data);
+		return 1;
+	}
+
+	return f->next->push(f->next, data, len);
+}
+
+/***********************************************************
+ *  tee: copies its input to each of its files and passes it
+ *  on. A file that fails is reported once and dropped
+ **********************************************************/
+static int teePush(Filter *f, const char *data, size_t len)
+{
+	int i;
+
+	for (i = 0; i < f->numFiles; i++)
+	{
+		if (f->files[i].fd != -1 && sinkWrite(&f->files[i], data, len) == -1)
+		{
+			perror("tee");
+			sinkClose(&f->files[i]);
+			close(f->files[i].fd);
+			f->files[i].fd = -1;
+			f->status = EXIT_FAILURE;
+		}
+	}
+
+	return f->next->push(f->next, data, len);
+}
+
+static int teeFinish(Filter *f)
+{
+	int i;
+
+	for (i = 0; i < f->numFiles; i++)
+	{
+		if (f->files[i].fd == -1)
+		{
+			continue;
+		}
+		if (sinkClose(&f->files[i]) == -1)
+		{
+			perror("tee");
+			f->status = EXIT_FAILURE;
+		}
+		close(f->files[i].fd);
+	}
+	free(f->files);
+
+	return 0;
+}
+
+/***********************************************************
+ *  Opens tee's files, with -a they are appended to
+ **********************************************************/
+static void teeOpen(Filter *f, CMD *stage)
+{
+	int append = stage->argv[1] && strcmp(stage->argv[1], "-a") == 0;
+	int j;
+
+	if (!(f->files = calloc(stage->numCmdTokens + 1, sizeof(AsyncSink))))
+	{
+		fprintf(stderr, "Buffer allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (j = 1 + append; stage->argv[j]; j++)
+	{
+		AsyncSink *sink = &f->files[f->numFiles++];
+		int fd = open(stage->argv[j], O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+
+		if (fd == -1)
+		{
+			perror(stage->argv[j]);
+			sink->fd = -1;
+			f->status = EXIT_FAILURE;
+		}
+		else
+		{
+			sinkOpen(sink, fd);	// Without buffers the file is written directly
+		}
+	}
+}
+
+/***********************************************************
+ *  Sets up the builtin version of a stage
+ **********************************************************/
+static void initFilter(Filter *f, CMD *stage, Filter *next)
+{
+	f->next = next;
+	f->push = catPush;
+	f->finish = noFinish;
+
+	if (strcmp(stage->argv[0], "grep") == 0)
+	{
+		f->push = grepPush;
+		f->finish = grepFinish;
+		f->pattern = stage->argv[2];
+		f->patternLen = strlen(f->pattern);
+		f->status = 1;	// grep fails until something matches
+	}
+	else if (strcmp(stage->argv[0], "head") == 0)
+	{
+		f->push = headPush;
+		f->lines = headLines(stage);
+	}
+	else if (strcmp(stage->argv[0], "tee") == 0)
+	{
+		f->push = teePush;
+		f->finish = teeFinish;
+		teeOpen(f, stage);
+	}
+}
+
+/***********************************************************
+ *  Feeds everything read from fd into the chain, returns 1
+ *  once the chain wants no more input
+ **********************************************************/
+static int pumpFd(Filter *chain, Filter *sink, int fd, char *batch, const char *name)
+{
+	ssize_t len;
+
+	while ((len = read(fd, batch, FUSED_BATCH)) != 0)
+	{
+		if (len == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			perror(name);
+			return 0;
+		}
+		if (chain->push(chain, batch, len))
+		{
+			return 1;
+		}
+
+		/* The sink only gathers the writes of one read, a slow input such as
+			tail -f must not hold output back until the carry fills */
+		if (sink->carryLen && sinkDrain(sink) == -1)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/***********************************************************
+ *  Runs stages[0..n-1] as one fused chain in this process.
+ *  Returns the exit status of the last stage
+ **********************************************************/
+int runFused(CMD *stages, int n)
+{
+	Filter *filters = calloc(n + 1, sizeof(Filter));
+	Filter *sink;
+	char *batch = malloc(FUSED_BATCH);
+	int i, status;
+
+	if (!filters || !batch)
+	{
+		fprintf(stderr, "Buffer allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	closeInherited(&stages[0]);
+	applyStageHints(&stages[0]);
+
+	for (i = 0; i < n; i++)
+	{
+		initFilter(&filters[i], &stages[i], &filters[i + 1]);
+	}
+
+	sink = &filters[n];
+	sink->push = sinkPush;
+	sink->finish = sinkFinish;
+	/* Like grep, write every push straight out to a terminal */
+	sink->carryCap = isatty(STDOUT_FILENO) ? 0 : FUSED_BATCH;
+	if (!(sink->carry = malloc(FUSED_BATCH)))
+	{
+		fprintf(stderr, "Buffer allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	if ((sink->files = malloc(sizeof(AsyncSink))) && (sinkOpen(sink->files, STDOUT_FILENO) == -1 || !sink->files->async))
+	{
+		free(sink->files);
+		sink->files = NULL;	// Not a file, the batches above are enough
+	}
+
+	/* cat reads its files, everything else reads stdin */
+	if (strcmp(stages[0].argv[0], "cat") == 0 && stages[0].argv[1])
+	{
+		for (i = 1; stages[0].argv[i]; i++)
+		{
+			int fd = open(stages[0].argv[i], O_RDONLY | O_CLOEXEC);
+			int done;
+
+			if (fd == -1)
+			{
+				perror(stages[0].argv[i]);
+				filters[0].status = EXIT_FAILURE;
+				continue;
+			}
+			done = pumpFd(&filters[0], sink, fd, batch, stages[0].argv[i]);
+			close(fd);
+			if (done)
+			{
+				break;
+			}
+		}
+	}
+	else
+	{
+		pumpFd(&filters[0], sink, STDIN_FILENO, batch, stages[0].argv[0]);
+	}
+
+	/* Flush the lines each stage held back, in order. Anything pushed into
+		a head that is already done goes nowhere */
+	for (i = 0; i <= n; i++)
+	{
+		filters[i].finish(&filters[i]);
+	}
+
+	status = filters[n - 1].status;
+	for (i = 0; i <= n; i++)
+	{
+		free(filters[i].carry);
+	}
+	free(sink->files);
+	free(filters);
+	free(batch);
+
+	return status;
+}
+
+/***********************************************************
+ *  Glob expansion
+ *  Directories are read with getdents64 in large batches and
+ *  their sorted listings are cached, keyed by the directory's
+ *  device and inode and checked against its mtime, so another
+ *  glob over the same directory only costs an fstat. The
+ *  cache lives in the shell process, which becomes the last
+ *  stage with exec, so in practice it only serves the globs
+ *  of one command line; later lines see it only after a
+ *  pipeline served by the result cache (-c), where the shell
+ *  keeps running. Only the last path component may contain
+ *  wildcards
+ **********************************************************/
+#define DIR_CACHE_SLOTS 64
+#define DENTS_BATCH (1 << 20)
+
+typedef struct dirListing
+{
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	char *names;	// The names, NUL separated
+	char **sorted;	// Pointers into names in byte order
+	int count;
+
+} DirListing;
+
+struct linuxDirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static DirListing dirCache[DIR_CACHE_SLOTS];
+
+/***********************************************************
+ *  Whether a word has any wildcards in it
+ **********************************************************/
+static int hasGlob(const char *word)
+{
+	return strpbrk(word, "*?[") != NULL;
+}
+
+/***********************************************************
+ *  Multikey quicksort (Bentley and Sedgewick). Partitions on
+ *  one character at a time, so each pass reads a byte per
+ *  string instead of comparing whole strings, and equal
+ *  prefixes are never compared twice
+ **********************************************************/
+static void stringSort(char **a, int n, int depth)
+{
+	while (n > 1)
+	{
+		int lt = 0, gt = n - 1, i = 1;
+		unsigned char pivot;
+		char *t;
+
+		/* Short runs go to insertion sort */
+		if (n < 16)
+		{
+			for (i = 1; i < n; i++)
+			{
+				int j;
+
+				for (j = i; j > 0 && strcmp(a[j - 1] + depth, a[j] + depth) > 0; j--)
+				{
+					t = a[j];
+					a[j] = a[j - 1];
+					a[j - 1] = t;
+				}
+			}
+			return;
+		}
+
+		t = a[0];
+		a[0] = a[n / 2];
+		a[n / 2] = t;
+		pivot = a[0][depth];
+
+		/* Three way partition on the character at depth */
+		while (i <= gt)
+		{
+			unsigned char c = a[i][depth];
+
+			if (c < pivot)
+			{
+				t = a[lt]; a[lt++] = a[i]; a[i++] = t;
+			}
+			else if (c > pivot)
+			{
+				t = a[gt]; a[gt--] = a[i]; a[i] = t;
+			}
+			else
+			{
+				i++;
+			}
+		}
+
+		stringSort(a, lt, depth);
+		if (pivot)
+		{
+			stringSort(a + lt, gt - lt + 1, depth + 1);
+		}
+		a += gt + 1;
+		n -= gt + 1;
+	}
+}
+
+/***********************************************************
+ *  Returns the sorted listing of a directory, from the cache
+ *  if the directory has not changed since it was read
+ **********************************************************/
+static DirListing *listDirectory(const char *path)
+{
+	DirListing *dl;
+	struct stat st;
+	char *dents;
+	size_t size = 0, cap = 0;
+	long n;
+	int fd, i;
+
+	if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+	{
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	dl = &dirCache[(st.st_ino ^ st.st_dev) % DIR_CACHE_SLOTS];
+	if (dl->names && dl->dev == st.st_dev && dl->ino == st.st_ino
+		&& dl->mtime.tv_sec == st.st_mtim.tv_sec && dl->mtime.tv_nsec == st.st_mtim.tv_nsec)
+	{
+		close(fd);
+		return dl;
+	}
+
+	/* Stale or a different directory, read it again */
+	free(dl->names);
+	free(dl->sorted);
+	dl->names = NULL;
+	dl->sorted = NULL;
+	dl->count = 0;
+
+	if (!(dents = malloc(DENTS_BATCH)))
+	{
+		fprintf(stderr, "Buffer allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while ((n = syscall(SYS_getdents64, fd, dents, DENTS_BATCH)) > 0)
+	{
+		long pos;
+
+		for (pos = 0; pos < n; )
+		{
+			struct linuxDirent64 *de = (struct linuxDirent64 *)(dents + pos);
+			size_t len = strlen(de->d_name) + 1;
+
+			pos += de->d_reclen;
+			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			{
+				continue;
+			}
+
+			if (size + len > cap)
+			{
+				cap = (size + len) * 2;
+				if (!(dl->names = realloc(dl->names, cap)))
+				{
+					fprintf(stderr, "Buffer allocation error\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			memcpy(dl->names + size, de->d_name, len);
+			size += len;
+			dl->count++;
+		}
+	}
+	free(dents);
+	close(fd);
+
+	if (n == -1)
+	{
+		perror(path);
+		free(dl->names);
+		dl->names = NULL;
+		dl->count = 0;
+		return NULL;
+	}
+
+	/* Point into the block only now that it has stopped moving */
+	if (!(dl->sorted = malloc(sizeof(char *) * (dl->count + 1))) || (!dl->names && !(dl->names = malloc(1))))
+	{
+		fprintf(stderr, "Buffer allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0, size = 0; i < dl->count; i++)
+	{
+		dl->sorted[i] = dl->names + size;
+		size += strlen(dl->sorted[i]) + 1;
+	}
+	stringSort(dl->sorted, dl->count, 0);
+
+	dl->dev = st.st_dev;
+	dl->ino = st.st_ino;
+	dl->mtime = st.st_mtim;
+
+	return dl;
+}
+
+/***********************************************************
+ *  Expands one pattern into the argument vector, returns the
+ *  number of words added. Nothing is added if no name matches
+ **********************************************************/
+static int expandPattern(CMD *cmd, const char *pattern, char ***argv, int *argc, int *cap)
+{
+	const char *slash = strrchr(pattern, '/');
+	const char *base = slash ? slash + 1 : pattern;
+	size_t dirLen = slash ? slash - pattern + 1 : 0;
+	char dir[PATH_MAX];
+	DirListing *dl;
+	char *block, *p;
+	size_t size = 0;
+	int i, first = *argc, matched = 0;
+
+	if (dirLen >= sizeof(dir))
+	{
+		return 0;
+	}
+	memcpy(dir, pattern, dirLen);
+	dir[dirLen] = '\0';
+
+	if (hasGlob(dir) || !(dl = listDirectory(dirLen ? dir : ".")))
+	{
+		return 0;
+	}
+
+	/* The listing is sorted, so matches come out in order */
+	for (i = 0; i < dl->count; i++)
+	{
+		if (fnmatch(base, dl->sorted[i], FNM_PERIOD) == 0)
+		{
+			if (*argc + 1 >= *cap)
+			{
+				*cap *= 2;
+				if (!(*argv = realloc(*argv, sizeof(char *) * *cap)))
+				{
+					fprintf(stderr, "Buffer allocation error\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			(*argv)[(*argc)++] = dl->sorted[i];	// Fixed up below
+			size += dirLen + strlen(dl->sorted[i]) + 1;
+			matched++;
+		}
+	}
+
+	if (!matched)
+	{
+		return 0;
+	}
+
+	/* Copy the words out of the cache, a later glob may replace the listing */
+	if (!(block = malloc(size)) || !(cmd->globMem = realloc(cmd->globMem, sizeof(char *) * (cmd->numGlobMem + 1))))
+	{
+		fprintf(stderr, "Buffer allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	cmd->globMem[cmd->numGlobMem++] = block;
+
+	for (i = first, p = block; i < *argc; i++)
+	{
+		size_t len = strlen((*argv)[i]) + 1;
+
+		memcpy(p, dir, dirLen);
+		memcpy(p + dirLen, (*argv)[i], len);
+		(*argv)[i] = p;
+		p += dirLen + len;
+	}
+
+	return matched;
+}
+
+/***********************************************************
+ *  Expands the globs in a command's argument vector. The
+ *  vector is rebuilt at whatever size the expansion needs.
+ *  Redirection file names are left alone
+ **********************************************************/
+void expandGlobs(CMD *cmd)
+{
+	char **argv;
+	int argc = 0, cap, j;
+
+	for (j = 0; j < cmd->numCmdTokens; j++)
+	{
+		if (hasGlob(cmd->argv[j]))
+		{
+			break;
+		}
+	}
+	if (j == cmd->numCmdTokens)
+	{
+		return;
+	}
+
+	cap = cmd->numCmdTokens + 1;
+	if (!(argv = malloc(sizeof(char *) * cap)))
+	{
+		fprintf(stderr, "Buffer allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (j = 0; j < cmd->numCmdTokens; j++)
+	{
+		char *word = cmd->argv[j];
+		int redirection = j > 0 && (strcmp(cmd->argv[j - 1], "<") == 0 || strcmp(cmd->argv[j - 1], ">") == 0);
+
+		if (redirection || !hasGlob(word) || !expandPattern(cmd, word, &argv, &argc, &cap))
+		{
+			if (argc + 1 >= cap)
+			{
+				cap *= 2;
+				if (!(argv = realloc(argv, sizeof(char *) * cap)))
+				{
+					fprintf(stderr, "Buffer allocation error\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			argv[argc++] = word;	// No match keeps the pattern as it is
+		}
+	}
+	argv[argc] = NULL;
+
+	free(cmd->argv);
+	cmd->argv = argv;
+	cmd->numCmdTokens = argc;
+}
+
+/***********************************************************
+ *  Command history
+ *  ~/.driver_history (or $DRIVER_HISTFILE) is append only.
+ *  Each command is one record, an 8 byte header and the
+ *  command, written with a single write() on an O_APPEND
+ *  descriptor so shells sharing the file never interleave.
+ *  The file is mmap'd rather than read, so starting a shell
+ *  costs the same however long the history is.
+ *
+ *  Searches use a trigram index in a second file. For every
+ *  trigram it keeps the history offsets of the records that
+ *  contain it, ascending, without repeats and delta coded as
+ *  varints, so most postings take a byte or two; a table of
+ *  the trigrams sorted for binary search follows the lists.
+ *  A search takes the query's rarest trigram and checks its
+ *  records newest first. Records added since the index was
+ *  written are scanned directly. Once they outgrow both
+ *  HIST_TAIL_MAX and an eighth of the indexed history, a
+ *  background process folds them into a fresh index
+ *  HIST_CHUNK bytes at a time and renames it into place;
+ *  searches never wait for it
+ **********************************************************/
+#define HIST_MAGIC 0x48534d44U	// "DMSH"
+#define HIST_INDEX_MAGIC 0x3258444948534d44ULL	// "DMSHIDX2"
+#define HIST_TAIL_MAX (64 * 1024)
+#define HIST_CHUNK (4 * 1024 * 1024)
+
+typedef struct histRecord
+{
+	uint32_t magic;
+	uint32_t len;
+
+} HistRecord;
+
+typedef struct histIndexHeader
+{
+	uint64_t magic;
+	uint64_t indexedEnd;	// History bytes the index covers
+	uint64_t numTrigrams;
+	uint64_t listsLen;	// Bytes of posting lists, padded to 8 in the file
+
+} HistIndexHeader;
+
+typedef struct histTrigram
+{
+	uint32_t trigram;
+	uint32_t count;	// Records in the list
+	uint64_t start;	// Where the list begins
+	uint64_t last;	// Offset of its newest record
+
+} HistTrigram;
+
+typedef struct histPosting
+{
+	uint32_t trigram;
+	uint32_t offset;	// Record offset from the start of the chunk
+
+} HistPosting;
+
+typedef struct history
+{
+	char path[PATH_MAX - 32], indexPath[PATH_MAX - 16];
+	int fd;	// O_APPEND descriptor for adding records
+	char *map;	// The history file
+	size_t mapLen;
+	char *indexMap;	// The index file
+	size_t indexLen;
+	const HistIndexHeader *header;
+	const unsigned char *lists;
+	const HistTrigram *trigrams;
+	size_t reindexAt;	// History length when a rebuild was last started
+
+} History;
+
+static History hist = { .fd = -1 };
+
+#define HIST_PAD(n) (((n) + 7) & ~(uint64_t)7)
+
+/***********************************************************
+ *  Maps the history and its index. A missing or broken
+ *  index only means searches scan more
+ **********************************************************/
+static void historyMap(void)
+{
+	struct stat st;
+	int fd;
+
+	if (hist.map)
+	{
+		munmap(hist.map, hist.mapLen);
+		hist.map = NULL;
+	}
+	if (hist.indexMap)
+	{
+		munmap(hist.indexMap, hist.indexLen);
+		hist.indexMap = NULL;
+	}
+	hist.header = NULL;
+
+	if ((fd = open(hist.path, O_RDONLY | O_CLOEXEC)) != -1)
+	{
+		if (fstat(fd, &st) == 0 && st.st_size > 0)
+		{
+			hist.mapLen = st.st_size;
+			if ((hist.map = mmap(NULL, hist.mapLen, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+			{
+				hist.map = NULL;
+			}
+		}
+		close(fd);
+	}
+
+	if ((fd = open(hist.indexPath, O_RDONLY | O_CLOEXEC)) != -1)
+	{
+		if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(HistIndexHeader))
+		{
+			hist.indexLen = st.st_size;
+			if ((hist.indexMap = mmap(NULL, hist.indexLen, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+			{
+				hist.indexMap = NULL;
+			}
+		}
+		close(fd);
+	}
+
+	if (hist.indexMap)
+	{
+		const HistIndexHeader *h = (const HistIndexHeader *)hist.indexMap;
+
+		if (h->magic == HIST_INDEX_MAGIC && h->indexedEnd <= hist.mapLen
+			&& sizeof(*h) + HIST_PAD(h->listsLen) + h->numTrigrams * sizeof(HistTrigram) == hist.indexLen)
+		{
+			hist.header = h;
+			hist.lists = (const unsigned char *)(h + 1);
+			hist.trigrams = (const HistTrigram *)(hist.lists + HIST_PAD(h->listsLen));
+		}
+	}
+}
+
+/***********************************************************
+ *  Opens the history at startup
+ **********************************************************/
+void historyOpen(void)
+{
+	const char *file = getenv("DRIVER_HISTFILE");
+	const char *home = getenv("HOME");
+
+	if (file)
+	{
+		snprintf(hist.path, sizeof(hist.path), "%s", file);
+	}
+	else if (home)
+	{
+		snprintf(hist.path, sizeof(hist.path), "%s/.driver_history", home);
+	}
+	else
+	{
+		return;
+	}
+	snprintf(hist.indexPath, sizeof(hist.indexPath), "%s.idx", hist.path);
+
+	if ((hist.fd = open(hist.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) == -1)
+	{
+		perror(hist.path);
+		return;
+	}
+	historyMap();
+}
+
+/***********************************************************
+ *  Appends a command as one record
+ **********************************************************/
+void historyAdd(const char *command, size_t len)
+{
+	HistRecord rec = { HIST_MAGIC, len };
+	char *record;
+
+	if (hist.fd == -1)
+	{
+		return;
+	}
+
+	/* One write() so the record lands in one piece */
+	if (!(record = malloc(sizeof(rec) + len)))
+	{
+		return;
+	}
+	memcpy(record, &rec, sizeof(rec));
+	memcpy(record + sizeof(rec), command, len);
+	if (write(hist.fd, record, sizeof(rec) + len) != (ssize_t)(sizeof(rec) + len))
+	{
+		perror(hist.path);
+	}
+	free(record);
+}
+
+/***********************************************************
+ *  Returns the record at off and moves off past it. Torn or
+ *  foreign bytes are skipped up to the next record header
+ **********************************************************/
+static const char *historyRecord(size_t *off, uint32_t *len)
+{
+	const uint32_t magic = HIST_MAGIC;
+
+	while (*off + sizeof(HistRecord) <= hist.mapLen)
+	{
+		HistRecord rec;
+
+		memcpy(&rec, hist.map + *off, sizeof(rec));
+		if (rec.magic == HIST_MAGIC && *off + sizeof(rec) + rec.len <= hist.mapLen)
+		{
+			*len = rec.len;
+			*off += sizeof(rec) + rec.len;
+			return hist.map + *off - rec.len;
+		}
+
+		/* Resynchronize on the next header */
+		const char *next = memmem(hist.map + *off + 1, hist.mapLen - *off - 1, &magic, sizeof(magic));
+		*off = next ? (size_t)(next - hist.map) : hist.mapLen;
+	}
+
+	return NULL;
+}
+
+/***********************************************************
+ *  Returns the record that ends at end and moves end back
+ *  to its start, or NULL when no record ends there (the
+ *  start of the file, or foreign bytes before end)
+ **********************************************************/
+static const char *historyPrevious(size_t *end, uint32_t *len)
+{
+	size_t off;
+
+	for (off = *end; off-- > 0 && *end - off >= sizeof(HistRecord); )
+	{
+		HistRecord rec;
+
+		memcpy(&rec, hist.map + off, sizeof(rec));
+		if (rec.magic == HIST_MAGIC && off + sizeof(rec) + rec.len == *end)
+		{
+			*len = rec.len;
+			*end = off;
+			return hist.map + off + sizeof(rec);
+		}
+	}
+
+	return NULL;
+}
+
+/***********************************************************
+ *  Whether a command matches a prefix or substring query
+ **********************************************************/
+static int historyMatch(const char *command, uint32_t len, const char *query, size_t queryLen, int prefix)
+{
+	if (prefix)
+	{
+		return len >= queryLen && memcmp(command, query, queryLen) == 0;
+	}
+	return memmem(command, len, query, queryLen) != NULL;
+}
+
+static uint32_t trigramAt(const char *p)
+{
+	return (uint32_t)(unsigned char)p[0] << 16 | (uint32_t)(unsigned char)p[1] << 8 | (unsigned char)p[2];
+}
+
+static int comparePostings(const void *a, const void *b)
+{
+	const HistPosting *x = a, *y = b;
+
+	if (x->trigram != y->trigram)
+	{
+		return x->trigram < y->trigram ? -1 : 1;
+	}
+	return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/***********************************************************
+ *  Writes v as a varint, 7 bits a byte with the high bit
+ *  set on all but the last. Returns the bytes written
+ **********************************************************/
+static size_t putVarint(FILE *fp, uint64_t v)
+{
+	unsigned char buf[10];
+	size_t n = 0;
+
+	while (v >= 0x80)
+	{
+		buf[n++] = (unsigned char)v | 0x80;
+		v >>= 7;
+	}
+	buf[n++] = (unsigned char)v;
+	fwrite(buf, 1, n, fp);
+
+	return n;
+}
+
+static uint64_t getVarint(const unsigned char **p, const unsigned char *end)
+{
+	uint64_t v = 0;
+	int shift = 0;
+
+	while (*p < end && shift < 64)
+	{
+		unsigned char byte = *(*p)++;
+
+		v |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+		{
+			break;
+		}
+		shift += 7;
+	}
+
+	return v;
+}
+
+/***********************************************************
+ *  Finds a trigram in the index, or NULL
+ **********************************************************/
+static const HistTrigram *historyTrigram(uint32_t trigram)
+{
+	uint64_t lo = 0, hi = hist.header->numTrigrams;
+
+	while (lo < hi)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (hist.trigrams[mid].trigram < trigram)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	return lo < hist.header->numTrigrams && hist.trigrams[lo].trigram == trigram ? &hist.trigrams[lo] : NULL;
+}
+
+/***********************************************************
+ *  Writes a new index: the current one with the postings of
+ *  up to HIST_CHUNK bytes of the records after it appended.
+ *  Every new offset is past every indexed one, so each old
+ *  list is copied as it is and the new deltas follow it.
+ *  Returns 0 when there was nothing left to index
+ **********************************************************/
+static int historyIndexChunk(void)
+{
+	uint64_t numOld = hist.header ? hist.header->numTrigrams : 0;
+	uint64_t listsLen = hist.header ? hist.header->listsLen : 0;
+	size_t base = hist.header ? hist.header->indexedEnd : 0;
+	size_t off = base, end = base;	// end is past the last complete record
+	HistPosting *added = NULL;
+	HistTrigram *table = NULL;
+	size_t numAdded = 0, capAdded = 0, numTable = 0, capTable = 0;
+	HistIndexHeader header;
+	char temp[PATH_MAX];
+	const char *command;
+	uint64_t written = 0;
+	uint32_t len;
+	uint64_t i, j;
+	FILE *fp;
+	int fd;
+
+	while (end - base < HIST_CHUNK && (command = historyRecord(&off, &len)) != NULL)
+	{
+		size_t start = off - len - sizeof(HistRecord);
+
+		for (i = 0; i + 3 <= len; i++)
+		{
+			if (numAdded == capAdded)
+			{
+				capAdded = capAdded ? capAdded * 2 : 4096;
+				if (!(added = realloc(added, sizeof(HistPosting) * capAdded)))
+				{
+					fprintf(stderr, "Buffer allocation error\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			added[numAdded].trigram = trigramAt(command + i);
+			added[numAdded].offset = start - base;
+			numAdded++;
+		}
+
+		/* A torn tail moves off to the end of the map, but it may be a record
+		still being written, so the index stops before it */
+		end = off;
+	}
+	if (end == base)
+	{
+		free(added);
+		return 0;
+	}
+
+	/* Sort the new postings and drop a trigram repeated within a record */
+	qsort(added, numAdded, sizeof(HistPosting), comparePostings);
+	for (i = 0, j = 0; i < numAdded; i++)
+	{
+		if (j == 0 || comparePostings(&added[j - 1], &added[i]) != 0)
+		{
+			added[j++] = added[i];
+		}
+	}
+	numAdded = j;
+
+	snprintf(temp, sizeof(temp), "%s.%d", hist.indexPath, (int)getpid());
+	if ((fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1 || !(fp = fdopen(fd, "w")))
+	{
+		perror(temp);
+		free(added);
+		return 0;
+	}
+
+	/* The lists go first and the table after them, the header once both are known */
+	fseek(fp, sizeof(header), SEEK_SET);
+	for (i = 0, j = 0; i < numOld || j < numAdded; )
+	{
+		HistTrigram entry = { 0, 0, written, 0 };
+
+		if (j == numAdded || (i < numOld && hist.trigrams[i].trigram <= added[j].trigram))
+		{
+			uint64_t to = i + 1 < numOld ? hist.trigrams[i + 1].start : listsLen;
+
+			entry = hist.trigrams[i++];
+			entry.start = written;
+			fwrite(hist.lists + hist.trigrams[i - 1].start, 1, to - hist.trigrams[i - 1].start, fp);
+			written += to - hist.trigrams[i - 1].start;
+		}
+		else
+		{
+			entry.trigram = added[j].trigram;
+		}
+
+		for ( ; j < numAdded && added[j].trigram == entry.trigram; j++)
+		{
+			uint64_t record = base + added[j].offset;
+
+			written += putVarint(fp, record - (entry.count ? entry.last : 0));
+			entry.last = record;
+			entry.count++;
+		}
+
+		if (numTable == capTable)
+		{
+			capTable = capTable ? capTable * 2 : 4096;
+			if (!(table = realloc(table, sizeof(HistTrigram) * capTable)))
+			{
+				fprintf(stderr, "Buffer allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		table[numTable++] = entry;
+	}
+
+	fwrite("\0\0\0\0\0\0\0", 1, HIST_PAD(written) - written, fp);
+	fwrite(table, sizeof(HistTrigram), numTable, fp);
+
+	header.magic = HIST_INDEX_MAGIC;
+	header.indexedEnd = end;
+	header.numTrigrams = numTable;
+	header.listsLen = written;
+	rewind(fp);
+	fwrite(&header, sizeof(header), 1, fp);
+
+	if (fclose(fp) != 0 || rename(temp, hist.indexPath) == -1)
+	{
+		perror(hist.indexPath);
+		unlink(temp);
+		end = base;
+	}
+	free(added);
+	free(table);
+
+	return end != base;
+}
+
+/***********************************************************
+ *  Brings the index up to date in a detached process, so
+ *  the shell carries on searching the tail meanwhile. The
+ *  lock on the history keeps shells from building at once
+ **********************************************************/
+static void historyReindex(void)
+{
+	pid_t pid;
+	int fd;
+
+	if ((pid = fork()) == -1)
+	{
+		return;
+	}
+	if (pid > 0)
+	{
+		waitpid(pid, NULL, 0);
+		return;
+	}
+
+	/* The grandchild does the work and init reaps it, so the shell has nothing to wait for */
+	if (fork() != 0)
+	{
+		_exit(EXIT_SUCCESS);
+	}
+	/* Let go of the terminal, and of whatever the shell's output goes to */
+	setsid();
+	if ((fd = open("/dev/null", O_RDWR | O_CLOEXEC)) != -1)
+	{
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+	}
+	if (nice(10) == -1 && errno)
+	{
+		perror("nice");
+	}
+
+	if ((fd = open(hist.path, O_RDONLY | O_CLOEXEC)) == -1 || flock(fd, LOCK_EX | LOCK_NB) == -1)
+	{
+		_exit(EXIT_SUCCESS);
+	}
+
+	/* Another shell may have finished an index while this one was starting */
+	historyMap();
+	while (hist.map && historyIndexChunk())
+	{
+		historyMap();
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+/***********************************************************
+ *  Returns a copy of the newest command that starts with
+ *  (prefix) or contains the query, or NULL
+ **********************************************************/
+char *historySearch(const char *query, int prefix)
+{
+	size_t queryLen = strlen(query);
+	size_t off, indexedEnd;
+	const char *command, *found = NULL;
+	uint32_t len, foundLen = 0;
+	struct stat st;
+	char *copy;
+
+	/* Pick up records added by this and other shells */
+	if (hist.fd == -1 || fstat(hist.fd, &st) == -1)
+	{
+		return NULL;
+	}
+	if ((size_t)st.st_size != hist.mapLen || !hist.map)
+	{
+		historyMap();
+	}
+	if (!hist.map)
+	{
+		return NULL;
+	}
+
+	indexedEnd = hist.header ? hist.header->indexedEnd : 0;
+	if (hist.mapLen - indexedEnd > HIST_TAIL_MAX && hist.mapLen - indexedEnd > indexedEnd / 8
+		&& hist.mapLen != hist.reindexAt)
+	{
+		hist.reindexAt = hist.mapLen;
+		historyReindex();
+	}
+
+	/* Records past the index are the newest, scan them first */
+	for (off = indexedEnd; (command = historyRecord(&off, &len)) != NULL; )
+	{
+		if (historyMatch(command, len, query, queryLen, prefix))
+		{
+			found = command;
+			foundLen = len;
+		}
+	}
+
+	if (!found && hist.header && queryLen < 3)
+	{
+		size_t end = indexedEnd;
+
+		/* Too short for a trigram, walk the indexed records newest first */
+		while (!found && (command = historyPrevious(&end, &len)) != NULL)
+		{
+			if (historyMatch(command, len, query, queryLen, prefix))
+			{
+				found = command;
+				foundLen = len;
+			}
+		}
+
+		/* Foreign bytes break the backward walk, scan what is left forward */
+		if (!found && end > 0)
+		{
+			for (off = 0; (command = historyRecord(&off, &len)) != NULL && off <= end; )
+			{
+				if (historyMatch(command, len, query, queryLen, prefix))
+				{
+					found = command;
+					foundLen = len;
+				}
+			}
+		}
+	}
+	else if (!found && hist.header)
+	{
+		const HistTrigram *best = NULL, *trigram;
+		uint64_t *records, i;
+		size_t q;
+
+		/* The query's rarest trigram has the fewest records to check, and one
+		the index has never seen means no indexed record matches */
+		for (q = 0; q + 3 <= queryLen; q++)
+		{
+			if (!(trigram = historyTrigram(trigramAt(query + q))))
+			{
+				best = NULL;
+				break;
+			}
+			if (!best || trigram->count < best->count)
+			{
+				best = trigram;
+			}
+		}
+
+		if (best && (records = malloc(sizeof(uint64_t) * best->count)))
+		{
+			const unsigned char *p = hist.lists + best->start;
+			const unsigned char *listEnd = hist.lists + hist.header->listsLen;
+			uint64_t record = 0;
+
+			for (i = 0; i < best->count; i++)
+			{
+				record += getVarint(&p, listEnd);
+				records[i] = record;
+			}
+			for (i = best->count; i-- > 0 && !found; )
+			{
+				off = records[i];
+				if ((command = historyRecord(&off, &len)) && historyMatch(command, len, query, queryLen, prefix))
+				{
+					found = command;
+					foundLen = len;
+				}
+			}
+			free(records);
+		}
+	}
+
+	if (!found || !(copy = malloc(foundLen + 1)))
+	{
+		return NULL;
+	}
+	memcpy(copy, found, foundLen);
+	copy[foundLen] = '\0';
+
+	return copy;
+}
@@ -13,13 +13,12 @@
 *		command | command
 *		command | command | ...
 *		command -options | command -options > file
-*	Known Issues:
-*		running command (-options) > file
-*		or command (-options) | command (-options) | ... > file
-*		will result in undesired results inside the file we are
-*		outputing to.
+*		command | command >z file.gz
+*		command <z file.gz | command
 ****************************************************************/
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <assert.h>
 #include <sys/types.h>
@@ -30,6 +29,9 @@
 #include <string.h>
 #include <sysexits.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <zlib.h>
 
 typedef struct command
 {
@@ -38,12 +40,32 @@ typedef struct command
 
 } Command;
 
+/* A compressed redirection, run on a thread between a file and a pipe */
+typedef struct zipJob
+{
+	int src, dst;
+	int compress;	// >z and >>z, otherwise <z
+	pthread_t thread;
+
+} ZipJob;
+
+#define ZIP_MAX_JOBS 64
+
+static ZipJob zipJobs[ZIP_MAX_JOBS];
+static int numZipJobs = 0;
+
 int countPipes(char *);
 void deleteNewline(char **);
 int tokenize(char **, Command *);
 void closeFd(int);
 void runPipe(Command *, int, int);
+void waitLast(Command *, int, int);
 void redirect(int, int);
+void closeInherited(void);
+int startInflate(int);
+int startDeflate(int);
+void startZipJobs(void);
+void finishZipJobs(void);
 
 int main(int argc, char **argv)
 {
@@ -126,9 +148,13 @@ int tokenize(char **command, Command *cmds)
 															// as well as any file after a redirection
 	int isInR = 0, isOutR = 0, isApp = 0;	// Recognizes input or output file redirection 
 											// as well as appension to a file
+	int isZip = 0;	// <z, >z and >>z redirect through gzip
 	int numCmds = 1, numTokens = 0;	// numCmds counts commands, starts at one since there
 									//	is always one command
 
+	cmds[0].fdIn = STDIN_FILENO;
+	cmds[0].fdOut = STDOUT_FILENO;
+
 	token = strtok(*command, DELIMS);
 	while (token != NULL)
 	{
@@ -143,6 +169,8 @@ int tokenize(char **command, Command *cmds)
 		{
 			numCmds++;	// Once we hit a pipe, we have finished a command.
 			cmdAfterPipe = 1;
+			cmds[numCmds - 1].fdIn = STDIN_FILENO;
+			cmds[numCmds - 1].fdOut = STDOUT_FILENO;
 			break;
 		}
 		case '<':
@@ -150,6 +178,7 @@ int tokenize(char **command, Command *cmds)
 			printf("Redirection: %s\n", token);
 			fileAfterR = 1;
 			isInR = 1;
+			isZip = (strcmp(token, "<z") == 0);
 			token = strtok(NULL, DELIMS);
 			continue;	// skip input redirection token, we dont need this in the command
 		}
@@ -157,11 +186,10 @@ int tokenize(char **command, Command *cmds)
 		{
 			printf("Redirection: %s\n", token);
 			
-			/* Check to see if we are appending to the file */
-			if (token[1] && token[1] == '>')
-			{
-				isApp = 1;
-			}
+			/* Check to see if we are appending to the file. Every redirection
+				sets both flags, so one '>>' does not leak into a later '>' */
+			isApp = (strcmp(token, ">>") == 0 || strcmp(token, ">>z") == 0);
+			isZip = (strcmp(token, ">z") == 0 || strcmp(token, ">>z") == 0);
 
 			fileAfterR = 1;
 			isOutR = 1;
@@ -191,11 +219,15 @@ int tokenize(char **command, Command *cmds)
 				/* If input redirection happens, open input file if it exists */
 				if (isInR)
 				{
-					if ((cmds[numCmds - 1].fdIn = open(token, O_RDONLY)) == -1)
+					if ((cmds[numCmds - 1].fdIn = open(token, O_RDONLY | O_CLOEXEC)) == -1)
 					{
 						perror("Input file failure: ");
 						exit(EXIT_FAILURE);
 					}
+					if (isZip)
+					{
+						cmds[numCmds - 1].fdIn = startInflate(cmds[numCmds - 1].fdIn);
+					}
 					isInR = 0;
 				}
 				/* If output redirection happens */
@@ -206,9 +238,9 @@ int tokenize(char **command, Command *cmds)
 					{
 						printf("Appending\n");
 						/* If it doesn't exist, create it and append */
-						if ((cmds[numCmds - 1].fdOut = open(token, O_WRONLY | O_APPEND, 0744)) == -1)
+						if ((cmds[numCmds - 1].fdOut = open(token, O_WRONLY | O_APPEND | O_CLOEXEC, 0744)) == -1)
 						{
-							if ((cmds[numCmds - 1].fdOut = open(token, O_WRONLY | O_CREAT | O_APPEND, 0744)) == -1)
+							if ((cmds[numCmds - 1].fdOut = open(token, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0744)) == -1)
 							{
 								perror(token);
 							}
@@ -217,7 +249,7 @@ int tokenize(char **command, Command *cmds)
 						else
 						{
 							closeFd(cmds[numCmds - 1].fdOut);
-							if ((cmds[numCmds - 1].fdOut = open(token, O_WRONLY | O_APPEND, 0744)) == -1)
+							if ((cmds[numCmds - 1].fdOut = open(token, O_WRONLY | O_APPEND | O_CLOEXEC, 0744)) == -1)
 							{
 								perror(token);
 							}
@@ -227,15 +259,22 @@ int tokenize(char **command, Command *cmds)
 					/* If we are not appending to the file, simply create it and truncate it */
 					else
 					{
-						if ((cmds[numCmds - 1].fdOut = open(token, O_WRONLY | O_CREAT | O_TRUNC, 0744)) == -1)
+						if ((cmds[numCmds - 1].fdOut = open(token, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0744)) == -1)
 						{
 							perror(token);
 						}
 					}
+					/* Appending a gzip member to a .gz file still makes a valid .gz file */
+					if (isZip && cmds[numCmds - 1].fdOut != -1)
+					{
+						cmds[numCmds - 1].fdOut = startDeflate(cmds[numCmds - 1].fdOut);
+					}
 					isOutR = 0;
 				}
 
 				fileAfterR = 0;
+				token = strtok(NULL, DELIMS);
+				continue;	// the file is not an argument of the command
 			}
 			/* Recognize the next command after a semicolon */
 			else if (cmdAfterS)
@@ -293,6 +332,7 @@ int tokenize(char **command, Command *cmds)
 			cmds[i].argv[argvIdx] = tokenV[j];
 			argvIdx++;
 		}
+		cmds[i].argv[argvIdx] = NULL;
 	}
 	
 	return numCmds;
@@ -313,7 +353,7 @@ void runPipe(Command *cmds, int numCmds, int numPipes)
 		int fds[2];
 		pid_t childpid;
 
-		if (pipe(fds) == -1)
+		if (pipe2(fds, O_CLOEXEC) == -1)
 		{
 			perror("Piping: ");
 			exit(EXIT_FAILURE);
@@ -332,7 +372,18 @@ void runPipe(Command *cmds, int numCmds, int numPipes)
 			redirect(in, STDIN_FILENO);
 			redirect(fds[1], STDOUT_FILENO);
 
+			/* A redirection on this command wins over the pipe */
+			if (cmds[i].fdIn != STDIN_FILENO)
+			{
+				redirect(cmds[i].fdIn, STDIN_FILENO);
+			}
+			if (cmds[i].fdOut != STDOUT_FILENO)
+			{
+				redirect(cmds[i].fdOut, STDOUT_FILENO);
+			}
+
 			/* Child executing the parent's command */
+			closeInherited();
 			execvp(cmds[i].argv[0],(char * const * ) cmds[i].argv);
 
 		}
@@ -344,29 +395,107 @@ void runPipe(Command *cmds, int numCmds, int numPipes)
 		}
 	}
 	
+	/* A .gz is only complete once its compression thread has flushed the
+	trailer, and the threads live in the shell, so with a compressed
+	redirection the shell stays around instead of becoming the last stage */
+	if (numZipJobs > 0)
+	{
+		waitLast(cmds, numPipes, in);
+	}
+
 	/* The children have done their job. Now the parent needs to execute the last
-	stage of the pipeline. Also, we need to find any i/o redirection that may have 
-	happened and redirect command's output to there. Currently not handling input redirection */
-	int j = 0;
-	for (j; j < numCmds; j++)
+	stage of the pipeline, with any i/o redirection that was given for it */
+	redirect(in, STDIN_FILENO);
+	if (cmds[i].fdIn != STDIN_FILENO)
+	{
+		redirect(cmds[i].fdIn, STDIN_FILENO);
+	}
+	if (cmds[i].fdOut != STDOUT_FILENO)
+	{
+		redirect(cmds[i].fdOut, STDOUT_FILENO);
+	}
+	closeInherited();
+	execvp(cmds[i].argv[0],(char * const *) cmds[i].argv);
+}
+
+/****************************************************************
+*	Runs the last stage in a child instead of exec'ing it, runs
+*	the compression threads while it goes, then waits for the
+*	stage and the threads before exiting with the stage's status
+****************************************************************/
+void waitLast(Command *cmds, int numPipes, int in)
+{
+	int j;
+	int status = 0;
+	pid_t pid;
+
+	fflush(NULL);
+	if ((pid = fork()) == -1)
+	{
+		perror("Fork: ");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid == 0)
 	{
-		if (cmds[j].fdIn && cmds[j].fdIn != STDIN_FILENO)
+		redirect(in, STDIN_FILENO);
+		if (cmds[numPipes].fdIn != STDIN_FILENO)
 		{
-			redirect(in, cmds[j].fdIn);
-			redirect(STDOUT_FILENO, STDOUT_FILENO);
-			execvp(cmds[i].argv[0], cmds[i].argv);
+			redirect(cmds[numPipes].fdIn, STDIN_FILENO);
 		}
-		else if (cmds[j].fdOut && cmds[j].fdOut != STDOUT_FILENO)
+		if (cmds[numPipes].fdOut != STDOUT_FILENO)
 		{
-			redirect(in, STDIN_FILENO);
-			redirect(cmds[j].fdOut, STDOUT_FILENO);
-			execvp(cmds[i].argv[0], cmds[i].argv);
+			redirect(cmds[numPipes].fdOut, STDOUT_FILENO);
 		}
+		closeInherited();
+		execvp(cmds[numPipes].argv[0], (char * const *) cmds[numPipes].argv);
+		perror(cmds[numPipes].argv[0]);
+		exit(EXIT_FAILURE);
 	}
 
-	redirect(in, STDIN_FILENO);
-	redirect(STDOUT_FILENO, STDOUT_FILENO);
-	execvp(cmds[i].argv[0],(char * const *) cmds[i].argv);
+	/* The threads only see EOF once the shell's copies of the stages' pipes are gone */
+	if (in != STDIN_FILENO)
+	{
+		close(in);
+	}
+	for (j = 0; j <= numPipes; j++)
+	{
+		if (cmds[j].fdIn != STDIN_FILENO)
+		{
+			close(cmds[j].fdIn);
+		}
+		if (cmds[j].fdOut != STDOUT_FILENO)
+		{
+			close(cmds[j].fdOut);
+		}
+	}
+
+	/* Every stage is forked by now, so no child is forked from a threaded
+	process. A stage that stops reading must not take the shell with it */
+	signal(SIGPIPE, SIG_IGN);
+	startZipJobs();
+
+	waitpid(pid, &status, 0);
+	finishZipJobs();
+	exit(WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
+}
+
+/****************************************************************
+*	Closes everything but stdin, stdout and stderr before a
+*	stage is executed, so no stage holds another stage's pipe
+*	or file open
+****************************************************************/
+void closeInherited(void)
+{
+	int fd;
+
+	if (close_range(STDERR_FILENO + 1, ~0U, 0) == -1)
+	{
+		for (fd = STDERR_FILENO + 1; fd < sysconf(_SC_OPEN_MAX); fd++)
+		{
+			close(fd);
+		}
+	}
 }
 
 /****************************************************************
@@ -402,4 +531,349 @@ void redirect(int oldFd, int newFd)
 			}
 		}
 	}
+	else
+	{
+		/* Already in place, but it may have been opened close-on-exec */
+		fcntl(newFd, F_SETFD, 0);
+	}
+}
+
+
+/****************************************************************
+*	Compression for <z, >z and >>z
+*	The shell runs zlib itself on one thread per compressed
+*	file, between the file and a pipe to the stage; nothing is
+*	executed and no gzip binary is looked up. The stage is a
+*	separate program, so that pipe stays, but the gzip process
+*	and its second pipe are gone. The shell cannot become the
+*	last stage with exec and keep its threads, so with a
+*	compressed redirection it forks the last stage as well and
+*	waits, and the threads only start once every stage is forked
+****************************************************************/
+#define ZIP_BLOCK (1 << 20)	// Bytes compressed per gzip member
+#define ZIP_MAX_THREADS 8
+
+typedef struct zipBlock
+{
+	unsigned char *in, *out;
+	size_t inLen, outLen;
+
+} ZipBlock;
+
+/****************************************************************
+*	Writes all of buf, returns -1 on failure
+****************************************************************/
+static int writeAll(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len > 0)
+	{
+		ssize_t n = write(fd, p, len);
+
+		if (n == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/****************************************************************
+*	Reads until buf is full or EOF, returns bytes read
+****************************************************************/
+static ssize_t readFull(int fd, void *buf, size_t len)
+{
+	size_t got = 0;
+
+	while (got < len)
+	{
+		ssize_t n = read(fd, (char *)buf + got, len - got);
+
+		if (n == 0)
+		{
+			break;
+		}
+		if (n == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		got += n;
+	}
+
+	return got;
+}
+
+/****************************************************************
+*	Compresses one block into a complete gzip member.
+*	Concatenated members are a valid gzip stream, which is
+*	what lets blocks be compressed in parallel
+****************************************************************/
+static void *deflateBlock(void *arg)
+{
+	ZipBlock *block = arg;
+	z_stream zs;
+
+	memset(&zs, 0, sizeof(zs));
+	block->outLen = 0;
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		return NULL;
+	}
+
+	zs.next_in = block->in;
+	zs.avail_in = block->inLen;
+	zs.next_out = block->out;
+	zs.avail_out = compressBound(ZIP_BLOCK) + 64;
+	if (deflate(&zs, Z_FINISH) == Z_STREAM_END)
+	{
+		block->outLen = zs.total_out;
+	}
+	deflateEnd(&zs);
+
+	return NULL;
+}
+
+/****************************************************************
+*	Deflate job: reads the stage's output from src and writes
+*	gzip to dst. Small outputs are compressed inline, large
+*	ones a batch of blocks at a time on one thread per CPU
+****************************************************************/
+static void deflateWorker(int src, int dst)
+{
+	ZipBlock blocks[ZIP_MAX_THREADS];
+	pthread_t threads[ZIP_MAX_THREADS];
+	long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int i, numBlocks, done = 0;
+
+	if (numThreads < 1)
+	{
+		numThreads = 1;
+	}
+	if (numThreads > ZIP_MAX_THREADS)
+	{
+		numThreads = ZIP_MAX_THREADS;
+	}
+
+	for (i = 0; i < numThreads; i++)
+	{
+		blocks[i].in = malloc(ZIP_BLOCK);
+		blocks[i].out = malloc(compressBound(ZIP_BLOCK) + 64);
+		if (!blocks[i].in || !blocks[i].out)
+		{
+			fprintf(stderr, "Buffer allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	while (!done)
+	{
+		/* Fill a batch of blocks */
+		for (numBlocks = 0; numBlocks < numThreads && !done; numBlocks++)
+		{
+			ssize_t n = readFull(src, blocks[numBlocks].in, ZIP_BLOCK);
+
+			if (n == -1)
+			{
+				perror("zip read");
+				exit(EXIT_FAILURE);
+			}
+			blocks[numBlocks].inLen = n;
+			done = (n < ZIP_BLOCK);
+		}
+
+		/* One block is compressed right here, more get a thread each */
+		if (numBlocks == 1)
+		{
+			deflateBlock(&blocks[0]);
+		}
+		else
+		{
+			for (i = 0; i < numBlocks; i++)
+			{
+				if (pthread_create(&threads[i], NULL, deflateBlock, &blocks[i]) != 0)
+				{
+					deflateBlock(&blocks[i]);
+					threads[i] = 0;
+				}
+			}
+			for (i = 0; i < numBlocks; i++)
+			{
+				if (threads[i])
+				{
+					pthread_join(threads[i], NULL);
+				}
+			}
+		}
+
+		/* Members go out in input order */
+		for (i = 0; i < numBlocks; i++)
+		{
+			if (blocks[i].inLen == 0 && (i > 0 || !done))
+			{
+				continue;
+			}
+			if (blocks[i].outLen == 0)
+			{
+				fprintf(stderr, "zip: deflate failed\n");
+				exit(EXIT_FAILURE);
+			}
+			if (writeAll(dst, blocks[i].out, blocks[i].outLen) == -1)
+			{
+				perror("zip write");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (close(dst) == -1)
+	{
+		perror("zip close");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/****************************************************************
+*	Inflate job: reads gzip from src and writes the plain data
+*	to dst for the stage to read. A stage that stops reading
+*	early ends it with EPIPE
+****************************************************************/
+static void inflateWorker(int src, int dst)
+{
+	gzFile gz = gzdopen(src, "rb");
+	char *buf = malloc(ZIP_BLOCK);
+	int n;
+
+	if (!gz || !buf)
+	{
+		fprintf(stderr, "zip: cannot open input\n");
+		exit(EXIT_FAILURE);
+	}
+	gzbuffer(gz, 1 << 17);
+
+	while ((n = gzread(gz, buf, ZIP_BLOCK)) > 0)
+	{
+		if (writeAll(dst, buf, n) == -1)
+		{
+			if (errno != EPIPE)
+			{
+				perror("zip write");
+			}
+			break;
+		}
+	}
+	if (n < 0)
+	{
+		int err;
+
+		fprintf(stderr, "zip: %s\n", gzerror(gz, &err));
+	}
+	gzclose(gz);
+	free(buf);
+	close(dst);	// The stage sees EOF
+}
+
+/****************************************************************
+*	Queues a compressed redirection, returns the pipe end the
+*	stage gets
+****************************************************************/
+static int addZipJob(int fileFd, int compress)
+{
+	int fds[2];
+	ZipJob *job;
+
+	if (numZipJobs == ZIP_MAX_JOBS)
+	{
+		fprintf(stderr, "Too many compressed redirections\n");
+		exit(EXIT_FAILURE);
+	}
+	if (pipe2(fds, O_CLOEXEC) == -1)
+	{
+		perror("Piping: ");
+		exit(EXIT_FAILURE);
+	}
+
+	job = &zipJobs[numZipJobs++];
+	job->compress = compress;
+	job->src = compress ? fds[0] : fileFd;
+	job->dst = compress ? fileFd : fds[1];
+
+	return compress ? fds[1] : fds[0];
+}
+
+/****************************************************************
+*	Decompresses fileFd for a stage, returns the descriptor the
+*	stage should read from
+****************************************************************/
+int startInflate(int fileFd)
+{
+	return addZipJob(fileFd, 0);
+}
+
+/****************************************************************
+*	Compresses a stage's output into fileFd, returns the
+*	descriptor the stage should write to
+****************************************************************/
+int startDeflate(int fileFd)
+{
+	return addZipJob(fileFd, 1);
+}
+
+static void *zipThread(void *arg)
+{
+	ZipJob *job = arg;
+
+	if (job->compress)
+	{
+		deflateWorker(job->src, job->dst);
+		close(job->src);
+	}
+	else
+	{
+		inflateWorker(job->src, job->dst);
+	}
+
+	return NULL;
+}
+
+/****************************************************************
+*	Starts a thread for every compressed redirection
+****************************************************************/
+void startZipJobs(void)
+{
+	int i;
+
+	for (i = 0; i < numZipJobs; i++)
+	{
+		if (pthread_create(&zipJobs[i].thread, NULL, zipThread, &zipJobs[i]) != 0)
+		{
+			fprintf(stderr, "zip: cannot start thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/****************************************************************
+*	Waits until every compressed file is complete
+****************************************************************/
+void finishZipJobs(void)
+{
+	int i;
+
+	for (i = 0; i < numZipJobs; i++)
+	{
+		pthread_join(zipJobs[i].thread, NULL);
+	}
+	numZipJobs = 0;
 }